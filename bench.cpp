@@ -0,0 +1,523 @@
+#include "contour.h"
+#include "field.h"
+#include "parallel.h"
+#include "png.h"
+#include "render.h"
+#include "solver.h"
+#include "tracer.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <numbers>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Times the stages of a frame on canned scenes. Every benchmark runs its operation in batches long enough
+// to time reliably and reports per-operation statistics over several batches, as a table on stdout and
+// optionally as JSON or CSV for tracking regressions.
+
+namespace
+{
+    struct options_t
+    {
+        std::string filter;
+        double min_time_ms = 20;
+        int32_t samples = 10;
+        std::string json, csv;
+        bool list = false;
+    };
+
+    struct result_t
+    {
+        std::string name;
+        std::string unit; // what one item is, for the throughput
+        double items_per_op = 1;
+        size_t iterations = 0; // operations per sample
+        std::vector<double> ns{}; // per operation, one entry per sample
+        double mean = 0, stddev = 0, min = 0, median = 0, max = 0;
+        // Benchmark specific counter per operation, such as field evaluations per traced line
+        std::string counter;
+        double counter_per_op = 0;
+    };
+
+    // Keeps the compiler from dropping a computation whose result is otherwise unused
+    template <typename value_t>
+    void keep(const value_t& value)
+    {
+#if defined(__GNUC__) || defined(__clang__)
+        asm volatile("" : : "r"(&value) : "memory");
+#else
+        static volatile const void* sink;
+        sink = &value;
+#endif
+    }
+
+    struct canned_t
+    {
+        std::string name;
+        charges_t charges;
+    };
+
+    charges_t randomCharges(size_t n, uint32_t seed)
+    {
+        std::mt19937 rng(seed);
+        std::uniform_real_distribution<float> position(-140.0f, 140.0f), strength(-60.0f, 60.0f);
+        charges_t charges;
+        charges.reserve(n);
+        for (size_t i = 0; i < n; i++)
+        {
+            charges.add({{position(rng), position(rng)}, strength(rng)});
+        }
+        return charges;
+    }
+
+    std::vector<canned_t> cannedScenes()
+    {
+        return {
+            {"dipole", {{{-60, 0}, -60}, {{60, 0}, 60}}},
+            {"quadrupole", {{{-60, 0}, -20}, {{60, 0}, -20}, {{0, 60}, 20}, {{0, -60}, 20}}},
+            {"random-100", randomCharges(100, 1)},
+            {"random-300", randomCharges(300, 2)},
+        };
+    }
+
+    std::vector<vec2_t> randomPoints(size_t n, uint32_t seed)
+    {
+        std::mt19937 rng(seed);
+        std::uniform_real_distribution<float> position(-150.0f, 150.0f);
+        std::vector<vec2_t> points(n);
+        for (vec2_t& p : points)
+        {
+            p = {position(rng), position(rng)};
+        }
+        return points;
+    }
+
+    class runner_t
+    {
+    public:
+        explicit runner_t(const options_t& options) : options(options) {}
+
+        std::vector<result_t> results;
+
+        // Whether run() would time `name` rather than skip or only list it, so costly setup can be left out otherwise
+        bool timed(const std::string& name) const { return !options.list && name.find(options.filter) != std::string::npos; }
+
+        // Times `op`, items_per_op of `unit` are processed per call. `count` returns what was counted since
+        // its last call, it is read after every sample and reported per operation as `counter`.
+        void run(const std::string& name, const std::string& unit, double items_per_op, const std::function<void()>& op,
+                 const std::string& counter = "", const std::function<double()>& count = nullptr)
+        {
+            if (name.find(options.filter) == std::string::npos)
+            {
+                return;
+            }
+            if (options.list)
+            {
+                std::cout << name << "\n";
+                return;
+            }
+            using clock = std::chrono::steady_clock;
+            result_t r{.name = name, .unit = unit, .items_per_op = items_per_op, .counter = counter};
+
+            // Warm up once, then grow the batch until it takes long enough to time
+            op();
+            size_t iterations = 1;
+            while (true)
+            {
+                auto start = clock::now();
+                for (size_t i = 0; i < iterations; i++)
+                {
+                    op();
+                }
+                double ms = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+                if (ms >= options.min_time_ms || iterations >= (size_t(1) << 30))
+                {
+                    break;
+                }
+                iterations *= ms > 0 ? std::clamp<size_t>(static_cast<size_t>(options.min_time_ms / ms * 1.2), 2, 16) : 16;
+            }
+            r.iterations = iterations;
+
+            double counted = 0;
+            if (count)
+            {
+                count(); // drop what the warm up and calibration counted
+            }
+            for (int32_t s = 0; s < options.samples; s++)
+            {
+                auto start = clock::now();
+                for (size_t i = 0; i < iterations; i++)
+                {
+                    op();
+                }
+                r.ns.push_back(std::chrono::duration<double, std::nano>(clock::now() - start).count() / iterations);
+                if (count)
+                {
+                    counted += count();
+                }
+            }
+            if (count)
+            {
+                r.counter_per_op = counted / (static_cast<double>(iterations) * options.samples);
+            }
+            summarize(r);
+            print(r);
+            results.push_back(std::move(r));
+        }
+
+    private:
+        const options_t& options;
+
+        static void summarize(result_t& r)
+        {
+            std::vector<double> sorted = r.ns;
+            std::ranges::sort(sorted);
+            double sum = 0;
+            for (double v : sorted)
+            {
+                sum += v;
+            }
+            r.mean = sum / sorted.size();
+            double squares = 0;
+            for (double v : sorted)
+            {
+                squares += (v - r.mean) * (v - r.mean);
+            }
+            r.stddev = sorted.size() > 1 ? std::sqrt(squares / (sorted.size() - 1)) : 0;
+            r.min = sorted.front();
+            r.max = sorted.back();
+            r.median = sorted.size() % 2 ? sorted[sorted.size() / 2] : 0.5 * (sorted[sorted.size() / 2 - 1] + sorted[sorted.size() / 2]);
+        }
+
+        static void print(const result_t& r)
+        {
+            std::printf("%-44s %14.1f ns/op  +-%5.1f%%  %12.4g %s/s", r.name.c_str(), r.mean, 100 * r.stddev / r.mean, r.items_per_op / r.mean * 1e9,
+                        r.unit.c_str());
+            if (!r.counter.empty())
+            {
+                std::printf("  %.1f %s/op", r.counter_per_op, r.counter.c_str());
+            }
+            std::printf("\n");
+            std::fflush(stdout);
+        }
+    };
+
+    void forceBenchmarks(runner_t& runner)
+    {
+        const size_t point_count = 1024;
+        std::vector<vec2_t> points = randomPoints(point_count, 7);
+        std::vector<vec2_t> forces(point_count);
+        for (size_t n : {16, 256, 4096, 65536})
+        {
+            charges_t charges = randomCharges(n, 3);
+            runner.run("forceAt/direct/" + std::to_string(n), "interactions", static_cast<double>(n * point_count),
+                       [&]
+                       {
+                           forceAt(charges, points, forces);
+                           keep(forces);
+                       });
+            for (method_t method : {method_t::barnes_hut, method_t::fmm})
+            {
+                if (n < 4096)
+                {
+                    continue;
+                }
+                solver_t solver;
+                solver.method = method;
+                solver.view_lo = vec2_t(-150.0f);
+                solver.view_hi = vec2_t(150.0f);
+                solver.prepare(charges);
+                std::string name = method == method_t::fmm ? "fmm" : "barnes_hut";
+                runner.run("forceAt/" + name + "/" + std::to_string(n), "points", static_cast<double>(point_count),
+                           [&]
+                           {
+                               solver.forceAt(points, forces);
+                               keep(forces);
+                           });
+            }
+        }
+    }
+
+    void traceBenchmarks(runner_t& runner, const std::vector<canned_t>& scenes)
+    {
+        const char* integrators[] = {"euler", "rk4", "rk45"};
+        render_settings_t settings;
+        trace_settings_t trace = settings.trace;
+        trace.max_length = static_cast<float>(settings.tmax);
+        trace.lo = settings.lo();
+        trace.hi = settings.hi();
+        for (const canned_t& scene : scenes)
+        {
+            solver_t solver;
+            solver.prepare(scene.charges);
+            // The same starting points render() uses
+            std::vector<std::pair<vec2_t, float>> starts;
+            for (size_t c = 0; c < scene.charges.size(); c++)
+            {
+                for (int32_t i = 1; i <= settings.num_lines; i++)
+                {
+                    float theta = i * (2 * std::numbers::pi) / settings.num_lines;
+                    starts.push_back({scene.charges.pos(c) + settings.line_dist * vec2_t(std::cos(theta), std::sin(theta)),
+                                      scene.charges.strength[c] > 0 ? 1.0f : -1.0f});
+                }
+            }
+            for (int32_t integrator = 0; integrator < 3; integrator++)
+            {
+                trace.integrator = static_cast<integrator_t>(integrator);
+                size_t evaluations = 0;
+                runner.run(
+                    std::string("trace/") + integrators[integrator] + "/" + scene.name, "lines", static_cast<double>(starts.size()),
+                    [&]
+                    {
+                        for (auto [p, sign] : starts)
+                        {
+                            polyline_t line = traceFieldLine(solver, p, sign, trace, evaluations);
+                            keep(line);
+                        }
+                    },
+                    "evaluations",
+                    [&]
+                    {
+                        return static_cast<double>(std::exchange(evaluations, 0));
+                    });
+            }
+        }
+    }
+
+    void equipotentialBenchmarks(runner_t& runner, const std::vector<canned_t>& scenes)
+    {
+        render_settings_t settings;
+        for (const canned_t& scene : scenes)
+        {
+            solver_t solver;
+            solver.prepare(scene.charges);
+            std::vector<float> levels;
+            for (size_t i = 0; i < scene.charges.size() && levels.size() < 32; i++)
+            {
+                for (int k = 1; k <= settings.ring_count; k++)
+                {
+                    levels.push_back(solver.potentialAt(scene.charges.pos(i) + vec2_t(static_cast<float>(k) * settings.equipotential_dist, 0.0f)));
+                }
+            }
+            std::ranges::sort(levels);
+            size_t segments = 0;
+            runner.run(
+                "equipotential/lattice+march/" + scene.name, "levels", static_cast<double>(levels.size()),
+                [&]
+                {
+                    equipotentials_t fresh;
+                    segments += fresh.extract(solver, scene.charges.version, settings.lo(), settings.hi(), levels).size();
+                },
+                "lines", [&] { return static_cast<double>(std::exchange(segments, 0)); });
+            equipotentials_t cached;
+            runner.run(
+                "equipotential/march/" + scene.name, "levels", static_cast<double>(levels.size()),
+                [&]
+                {
+                    segments += cached.extract(solver, scene.charges.version, settings.lo(), settings.hi(), levels).size();
+                },
+                "lines", [&] { return static_cast<double>(std::exchange(segments, 0)); });
+        }
+    }
+
+    void arrowBenchmarks(runner_t& runner)
+    {
+        render_settings_t settings;
+        std::vector<color_t> pixels(static_cast<size_t>(settings.width) * settings.height);
+        canvas_t canvas{pixels, settings};
+        std::vector<vec2_t> positions = randomPoints(1000, 11);
+        std::vector<vec2_t> directions = randomPoints(1000, 12);
+        for (vec2_t& d : directions)
+        {
+            d = glm::normalize(d);
+        }
+        runner.run("arrows/stamp", "arrows", static_cast<double>(positions.size()),
+                   [&]
+                   {
+                       for (size_t i = 0; i < positions.size(); i++)
+                       {
+                           canvas.drawArrow(positions[i], directions[i]);
+                       }
+                       keep(pixels);
+                   });
+    }
+
+    void renderBenchmarks(runner_t& runner, std::vector<canned_t>& scenes)
+    {
+        struct variant_t
+        {
+            const char* name;
+            render_settings_t settings;
+        };
+        std::vector<variant_t> variants = {{"lines", {}}, {"heatmap", {}}};
+        variants[1].settings.fieldcolor = true;
+        for (canned_t& scene : scenes)
+        {
+            for (const variant_t& variant : variants)
+            {
+                std::vector<color_t> pixels(static_cast<size_t>(variant.settings.width) * variant.settings.height);
+                double pixel_count = static_cast<double>(pixels.size());
+                renderer_t renderer;
+                runner.run("render/" + std::string(variant.name) + "/" + scene.name, "pixels", pixel_count,
+                           [&]
+                           {
+                               renderer.render(scene.charges, variant.settings, pixels);
+                               keep(pixels);
+                           });
+                // A new version every frame, as while dragging a charge, so no cache survives
+                runner.run("render-cold/" + std::string(variant.name) + "/" + scene.name, "pixels", pixel_count,
+                           [&]
+                           {
+                               scene.charges.touch();
+                               renderer.render(scene.charges, variant.settings, pixels);
+                               keep(pixels);
+                           });
+            }
+        }
+    }
+
+    void deflateBenchmarks(runner_t& runner, std::vector<canned_t>& scenes)
+    {
+        // A heatmap frame at 1080p, smooth gradients with lines over them like a real export
+        render_settings_t settings;
+        settings.width = 1920;
+        settings.height = 1080;
+        settings.zoom = 6.4f;
+        settings.fieldcolor = true;
+        // Rendered by the first benchmark that runs, none may
+        std::vector<color_t> pixels;
+        double pixel_count = static_cast<double>(settings.width) * settings.height;
+        std::string path = (std::filesystem::temp_directory_path() / "gauss-bench.png").string();
+
+        // The same image under pools of growing size, blocks are deflated on every thread of the pool
+        size_t hardware = std::max(1u, std::thread::hardware_concurrency());
+        for (size_t threads = 1;; threads = std::min(2 * threads, hardware))
+        {
+            std::string name = "png/deflate/" + std::to_string(threads) + "-threads";
+            if (pixels.empty() && runner.timed(name))
+            {
+                pixels.resize(static_cast<size_t>(settings.width) * settings.height);
+                renderer_t renderer;
+                renderer.render(scenes[2].charges, settings, pixels);
+            }
+            thread_pool_t workers(threads);
+            pool_scope_t scope(workers);
+            runner.run(name, "pixels", pixel_count,
+                       [&]
+                       {
+                           png_writer_t writer;
+                           std::string error;
+                           bool ok = writer.open(path, settings.width, settings.height, 6, error);
+                           for (size_t row = 0; ok && row < static_cast<size_t>(settings.height); row += 64)
+                           {
+                               size_t rows = std::min<size_t>(64, settings.height - row);
+                               ok = writer.write(std::span(pixels).subspan(row * settings.width, rows * settings.width), error);
+                           }
+                           if (!ok || !writer.close(error))
+                           {
+                               std::cerr << error << "\n";
+                               std::exit(1);
+                           }
+                       });
+            if (threads == hardware)
+            {
+                break;
+            }
+        }
+        if (!pixels.empty())
+        {
+            std::filesystem::remove(path);
+        }
+    }
+
+    void writeJSON(const std::string& path, const std::vector<result_t>& results)
+    {
+        std::ofstream out(path);
+        out.precision(9);
+        out << "{\n  \"kernel\": \"" << forceKernelName() << "\",\n  \"threads\": " << pool().size() << ",\n  \"results\": [\n";
+        for (size_t i = 0; i < results.size(); i++)
+        {
+            const result_t& r = results[i];
+            out << "    {\"name\": \"" << r.name << "\", \"ns_per_op\": " << r.mean << ", \"stddev_ns\": " << r.stddev << ", \"min_ns\": " << r.min
+                << ", \"median_ns\": " << r.median << ", \"max_ns\": " << r.max << ", \"iterations\": " << r.iterations << ", \"samples\": " << r.ns.size()
+                << ", \"unit\": \"" << r.unit << "\", \"items_per_op\": " << r.items_per_op << ", \"items_per_second\": " << r.items_per_op / r.mean * 1e9;
+            if (!r.counter.empty())
+            {
+                out << ", \"counter\": \"" << r.counter << "\", \"counter_per_op\": " << r.counter_per_op;
+            }
+            out << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+        }
+        out << "  ]\n}\n";
+    }
+
+    void writeCSV(const std::string& path, const std::vector<result_t>& results)
+    {
+        std::ofstream out(path);
+        out.precision(9);
+        out << "name,ns_per_op,stddev_ns,min_ns,median_ns,max_ns,iterations,samples,unit,items_per_op,items_per_second,counter,counter_per_op\n";
+        for (const result_t& r : results)
+        {
+            out << r.name << "," << r.mean << "," << r.stddev << "," << r.min << "," << r.median << "," << r.max << "," << r.iterations << "," << r.ns.size()
+                << "," << r.unit << "," << r.items_per_op << "," << r.items_per_op / r.mean * 1e9 << "," << r.counter << "," << r.counter_per_op << "\n";
+        }
+    }
+} // namespace
+
+int main(int argc, char** argv)
+{
+    options_t options;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--filter" && has_value)
+            options.filter = argv[++i];
+        else if (arg == "--min-time" && has_value)
+            options.min_time_ms = std::atof(argv[++i]);
+        else if (arg == "--samples" && has_value)
+            options.samples = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "--json" && has_value)
+            options.json = argv[++i];
+        else if (arg == "--csv" && has_value)
+            options.csv = argv[++i];
+        else if (arg == "--list")
+            options.list = true;
+        else
+        {
+            std::cerr << "usage: bench [--filter substring] [--min-time ms] [--samples n] [--json file] [--csv file] [--list]\n";
+            return 1;
+        }
+    }
+
+    if (!options.list)
+    {
+        std::printf("kernel %s, %zu threads, %d samples of at least %.0f ms each\n", forceKernelName(), pool().size(), options.samples, options.min_time_ms);
+    }
+    runner_t runner(options);
+    std::vector<canned_t> scenes = cannedScenes();
+    forceBenchmarks(runner);
+    traceBenchmarks(runner, scenes);
+    equipotentialBenchmarks(runner, scenes);
+    arrowBenchmarks(runner);
+    renderBenchmarks(runner, scenes);
+    deflateBenchmarks(runner, scenes);
+
+    if (!options.json.empty())
+    {
+        writeJSON(options.json, runner.results);
+    }
+    if (!options.csv.empty())
+    {
+        writeCSV(options.csv, runner.results);
+    }
+    return 0;
+}
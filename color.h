@@ -0,0 +1,10 @@
+#pragma once
+#include <cstdint>
+#include <glm/glm.hpp>
+
+using color_t = glm::vec<4, uint8_t>;
+
+namespace colors
+{
+    constexpr color_t red(255, 0, 0, 0), green(0, 255, 0, 0), blue(0, 0, 255, 0), white(255, 255, 255, 0), black(0, 0, 0, 0), yellow(255, 255, 0, 0);
+}
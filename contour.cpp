@@ -0,0 +1,251 @@
+#include "contour.h"
+#include "parallel.h"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <iterator>
+#include <limits>
+
+namespace
+{
+    // Cell edges: 0 bottom, 1 right, 2 top, 3 left. Up to two segments per case, -1 terminated.
+    // Saddles (5 and 10) are listed for a center below the level and flipped when it is above.
+    constexpr std::array<std::array<int8_t, 5>, 16> segment_table = {{
+        {-1},
+        {3, 0, -1},
+        {0, 1, -1},
+        {3, 1, -1},
+        {1, 2, -1},
+        {3, 0, 1, 2, -1},
+        {0, 2, -1},
+        {2, 3, -1},
+        {2, 3, -1},
+        {0, 2, -1},
+        {0, 1, 2, 3, -1},
+        {1, 2, -1},
+        {3, 1, -1},
+        {0, 1, -1},
+        {3, 0, -1},
+        {-1},
+    }};
+} // namespace
+
+std::vector<polyline_t> marchingSquares(std::span<const float> values, int32_t nx, int32_t ny, vec2_t origin, float spacing, float level,
+                                        const lattice_ranges_t* ranges, glm::ivec2 first)
+{
+    // Horizontal edges first, (i, j) -> (i + 1, j) is j * (nx - 1) + i, then vertical ones (i, j) -> (i, j + 1)
+    const int32_t horizontal = (nx - 1) * ny;
+    auto value = [&](int32_t i, int32_t j) { return values[static_cast<size_t>(j) * nx + i]; };
+    auto edgeId = [&](int32_t i, int32_t j, int32_t edge)
+    {
+        switch (edge)
+        {
+        case 0:
+            return j * (nx - 1) + i;
+        case 1:
+            return horizontal + j * nx + i + 1;
+        case 2:
+            return (j + 1) * (nx - 1) + i;
+        default:
+            return horizontal + j * nx + i;
+        }
+    };
+    auto crossing = [&](int32_t edge)
+    {
+        int32_t i0, j0, i1, j1;
+        if (edge < horizontal)
+        {
+            i0 = edge % (nx - 1);
+            j0 = edge / (nx - 1);
+            i1 = i0 + 1;
+            j1 = j0;
+        }
+        else
+        {
+            i0 = (edge - horizontal) % nx;
+            j0 = (edge - horizontal) / nx;
+            i1 = i0;
+            j1 = j0 + 1;
+        }
+        float a = value(i0, j0), b = value(i1, j1);
+        float t = a != b ? std::clamp((level - a) / (b - a), 0.0f, 1.0f) : 0.5f;
+        return origin + spacing * vec2_t(first.x + i0 + t * (i1 - i0), first.y + j0 + t * (j1 - j0));
+    };
+
+    std::vector<std::array<int32_t, 2>> segments;
+    auto march = [&](int32_t i_begin, int32_t i_end, int32_t j_begin, int32_t j_end)
+    {
+        for (int32_t j = j_begin; j < j_end; j++)
+        {
+            for (int32_t i = i_begin; i < i_end; i++)
+            {
+                float v00 = value(i, j), v10 = value(i + 1, j), v11 = value(i + 1, j + 1), v01 = value(i, j + 1);
+                int32_t index = (v00 >= level) | (v10 >= level) << 1 | (v11 >= level) << 2 | (v01 >= level) << 3;
+                if ((index == 5 || index == 10) && 0.25f * (v00 + v10 + v11 + v01) >= level)
+                {
+                    index ^= 15;
+                }
+                const auto& edges = segment_table[index];
+                for (size_t e = 0; edges[e] >= 0; e += 2)
+                {
+                    segments.push_back({edgeId(i, j, edges[e]), edgeId(i, j, edges[e + 1])});
+                }
+            }
+        }
+    };
+    if (ranges)
+    {
+        // A block only holds segments if the level lies between its smallest and largest node
+        const int32_t b = lattice_ranges_t::block;
+        for (int32_t bj = 0; bj < ranges->by; bj++)
+        {
+            for (int32_t bi = 0; bi < ranges->bx; bi++)
+            {
+                auto [lo, hi] = ranges->range[static_cast<size_t>(bj) * ranges->bx + bi];
+                if (lo < level && level <= hi)
+                {
+                    march(bi * b, std::min(bi * b + b, nx - 1), bj * b, std::min(bj * b + b, ny - 1));
+                }
+            }
+        }
+    }
+    else
+    {
+        march(0, nx - 1, 0, ny - 1);
+    }
+
+    // Pair up the segment ends that share a crossing, every crossing is shared by at most two segments
+    // so the segments form simple chains. Sorting the ends keeps this proportional to the line length.
+    std::vector<std::array<int32_t, 2>> ends; // crossing, 2 * segment + end
+    ends.reserve(2 * segments.size());
+    for (int32_t s = 0; s < static_cast<int32_t>(segments.size()); s++)
+    {
+        ends.push_back({segments[s][0], 2 * s});
+        ends.push_back({segments[s][1], 2 * s + 1});
+    }
+    std::ranges::sort(ends);
+    std::vector<int32_t> neighbor(ends.size(), -1); // segment end -> the other segment end on its crossing
+    for (size_t e = 0; e + 1 < ends.size(); e++)
+    {
+        if (ends[e][0] == ends[e + 1][0])
+        {
+            neighbor[ends[e][1]] = ends[e + 1][1];
+            neighbor[ends[e + 1][1]] = ends[e][1];
+            e++;
+        }
+    }
+    std::vector<bool> visited(segments.size(), false);
+    std::vector<polyline_t> lines;
+    // Follows the chain that enters segment s through its end k
+    auto walk = [&](int32_t s, int32_t k)
+    {
+        polyline_t line{crossing(segments[s][k])};
+        while (!visited[s])
+        {
+            visited[s] = true;
+            line.push_back(crossing(segments[s][1 - k]));
+            int32_t next = neighbor[2 * s + 1 - k];
+            if (next < 0)
+            {
+                break;
+            }
+            s = next / 2;
+            k = next % 2;
+        }
+        lines.push_back(std::move(line));
+    };
+    // Open chains start from a crossing that only one segment touches, whatever is left is closed loops
+    for (int32_t s = 0; s < static_cast<int32_t>(segments.size()); s++)
+    {
+        for (int32_t k = 0; k < 2; k++)
+        {
+            if (!visited[s] && neighbor[2 * s + k] < 0)
+            {
+                walk(s, k);
+            }
+        }
+    }
+    for (int32_t s = 0; s < static_cast<int32_t>(segments.size()); s++)
+    {
+        if (!visited[s])
+        {
+            walk(s, 0);
+        }
+    }
+    return lines;
+}
+
+void lattice_ranges_t::build(std::span<const float> values, int32_t nx, int32_t ny)
+{
+    bx = std::max(1, (nx - 1 + block - 1) / block);
+    by = std::max(1, (ny - 1 + block - 1) / block);
+    range.resize(static_cast<size_t>(bx) * by);
+    parallelFor(by,
+                [&](size_t begin, size_t end)
+                {
+                    for (size_t bj = begin; bj < end; bj++)
+                    {
+                        for (int32_t bi = 0; bi < bx; bi++)
+                        {
+                            // Nodes on the far side of the block belong to its cells too
+                            float lo = std::numeric_limits<float>::infinity(), hi = -lo;
+                            for (int32_t j = static_cast<int32_t>(bj) * block; j <= std::min(static_cast<int32_t>(bj + 1) * block, ny - 1); j++)
+                            {
+                                for (int32_t i = bi * block; i <= std::min((bi + 1) * block, nx - 1); i++)
+                                {
+                                    float v = values[static_cast<size_t>(j) * nx + i];
+                                    lo = std::min(lo, v);
+                                    hi = std::max(hi, v);
+                                }
+                            }
+                            range[bj * bx + bi] = {lo, hi};
+                        }
+                    }
+                });
+}
+
+const std::vector<polyline_t>& equipotentials_t::extract(const solver_t& solver, uint64_t version, vec2_t lo, vec2_t hi, std::span<const float> levels)
+{
+    if (version != built_version || solver.settingsKey() != built_source || spacing != built_spacing || lo != built_lo || hi != built_hi)
+    {
+        built_version = version;
+        built_source = solver.settingsKey();
+        built_spacing = spacing;
+        built_lo = lo;
+        built_hi = hi;
+        nx = std::max(2, static_cast<int32_t>(std::ceil((hi.x - lo.x) / spacing)));
+        ny = std::max(2, static_cast<int32_t>(std::ceil((hi.y - lo.y) / spacing)));
+        potential.resize(static_cast<size_t>(nx) * ny);
+        // Nodes sit at cell centers so a charge on an integer position never lands exactly on one
+        parallelFor(ny,
+                    [&](size_t begin, size_t end)
+                    {
+                        std::vector<vec2_t> row(nx);
+                        for (size_t j = begin; j < end; j++)
+                        {
+                            for (int32_t i = 0; i < nx; i++)
+                            {
+                                row[i] = lo + spacing * vec2_t(i + 0.5f, j + 0.5f);
+                            }
+                            solver.potentialAt(row, std::span(potential).subspan(j * nx, nx));
+                        }
+                    });
+        ranges.build(potential, nx, ny);
+    }
+
+    std::vector<std::vector<polyline_t>> per_level(levels.size());
+    parallelFor(levels.size(),
+                [&](size_t begin, size_t end)
+                {
+                    for (size_t l = begin; l < end; l++)
+                    {
+                        per_level[l] = marchingSquares(potential, nx, ny, lo + vec2_t(0.5f * spacing), spacing, levels[l], &ranges);
+                    }
+                });
+    lines.clear();
+    for (auto& level : per_level)
+    {
+        std::ranges::move(level, std::back_inserter(lines));
+    }
+    return lines;
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include "solver.h"
+#include <array>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+using polyline_t = std::vector<vec2_t>;
+
+// Smallest and largest value over blocks of block x block cells of a lattice
+struct lattice_ranges_t
+{
+    static constexpr int32_t block = 16;
+    int32_t bx = 0, by = 0;
+    std::vector<std::array<float, 2>> range;
+
+    void build(std::span<const float> values, int32_t nx, int32_t ny);
+};
+
+// Iso-lines of a lattice of values, node (i, j) at origin + spacing * (first + (i, j)). Lines that close on
+// themselves end with their first point, lines that leave the lattice end on its border.
+// With `ranges` of the same lattice only the blocks the level passes through are visited.
+// Pieces of one larger lattice passed with their own `first` and the shared origin give the exact same points.
+std::vector<polyline_t> marchingSquares(std::span<const float> values, int32_t nx, int32_t ny, vec2_t origin, float spacing, float level,
+                                        const lattice_ranges_t* ranges = nullptr, glm::ivec2 first = glm::ivec2(0));
+
+// Equipotential lines from a cached potential lattice over the view region
+class equipotentials_t
+{
+public:
+    float spacing = 1.0f;
+
+    // Re-evaluates the lattice only when the charges, the solver settings or the region changed,
+    // then extracts every level in parallel. Lines come back grouped by level in the order given.
+    const std::vector<polyline_t>& extract(const solver_t& solver, uint64_t version, vec2_t lo, vec2_t hi, std::span<const float> levels);
+
+private:
+    uint64_t built_version = ~uint64_t(0), built_source = 0;
+    float built_spacing = 0;
+    vec2_t built_lo, built_hi;
+    int32_t nx = 0, ny = 0;
+    std::vector<float> potential;
+    lattice_ranges_t ranges;
+    std::vector<polyline_t> lines;
+};
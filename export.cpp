@@ -0,0 +1,608 @@
+#include "export.h"
+#include "parallel.h"
+#include "png.h"
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <vector>
+
+namespace
+{
+    // Something drawn over the background, kept in every tile its pixels may touch
+    struct item_t
+    {
+        enum kind_t : uint32_t
+        {
+            segment, // segment `part` of field line `index`
+            arrow,   // arrow `index`
+            charge,  // marker of charge `index`
+        } kind;
+        uint32_t index, part;
+    };
+
+    // Lattice nodes sit at lo + spacing * (i + 0.5, j + 0.5) for the whole image, as on screen
+    struct lattice_t
+    {
+        vec2_t lo;
+        float spacing;
+        int32_t nx, ny;
+    };
+
+    // What every export draws, worked out once for the whole image
+    struct geometry_t
+    {
+        render_settings_t settings;
+        solver_t own_solver;
+        solver_t& solver;
+        std::vector<field_line_t> lines;
+        std::vector<std::array<vec2_t, 2>> arrows; // position and direction
+        std::vector<float> levels;
+        lattice_t lattice{};
+
+        geometry_t(const charges_t& charges, const render_settings_t& view, solver_t* shared) : settings(view), solver(shared ? *shared : own_solver)
+        {
+            // A field grid at export resolution would be as large as the image
+            settings.use_grid = false;
+            prepareSolver(solver, charges, settings);
+            if (settings.fieldlines && settings.num_lines > 0)
+            {
+                lines = traceFieldLines(solver, charges, settings);
+                if (settings.symmetry)
+                {
+                    clipFieldLines(lines, charges);
+                }
+            }
+            for (size_t l = 0; l < lines.size() && settings.arrows; l++)
+            {
+                vec2_t pos, dir;
+                if (arrowOf(lines[l], settings, pos, dir))
+                {
+                    arrows.push_back({pos, dir});
+                }
+            }
+            if (settings.equipotential)
+            {
+                levels = equipotentialLevels(solver, charges, settings);
+                lattice.lo = settings.lo();
+                lattice.spacing = settings.equipotential_spacing / settings.zoom;
+                lattice.nx = std::max(2, static_cast<int32_t>(std::ceil((settings.hi().x - lattice.lo.x) / lattice.spacing)));
+                lattice.ny = std::max(2, static_cast<int32_t>(std::ceil((settings.hi().y - lattice.lo.y) / lattice.spacing)));
+            }
+        }
+
+        // Calls visit(line) for the equipotentials through the cells [i0, i1) x [j0, j1). The cells are marched
+        // with their global node indices, so a cell gives the same points whichever piece of the lattice it is in.
+        template <typename visit_t>
+        void equipotentials(int32_t i0, int32_t i1, int32_t j0, int32_t j1, std::vector<float>& potential, visit_t&& visit) const
+        {
+            i0 = std::clamp(i0, 0, lattice.nx - 1);
+            i1 = std::clamp(i1, 0, lattice.nx - 1);
+            j0 = std::clamp(j0, 0, lattice.ny - 1);
+            j1 = std::clamp(j1, 0, lattice.ny - 1);
+            int32_t nx = i1 - i0 + 1, ny = j1 - j0 + 1;
+            if (levels.empty() || nx < 2 || ny < 2)
+            {
+                return;
+            }
+            potential.resize(static_cast<size_t>(nx) * ny);
+            parallelFor(ny,
+                        [&](size_t begin, size_t end)
+                        {
+                            std::vector<vec2_t> row(nx);
+                            for (size_t j = begin; j < end; j++)
+                            {
+                                for (int32_t i = 0; i < nx; i++)
+                                {
+                                    row[i] = lattice.lo + lattice.spacing * vec2_t(i0 + i + 0.5f, j0 + j + 0.5f);
+                                }
+                                solver.potentialAt(row, std::span(potential).subspan(j * nx, nx));
+                            }
+                        });
+            lattice_ranges_t ranges;
+            ranges.build(potential, nx, ny);
+            for (float level : levels)
+            {
+                for (const polyline_t& line : marchingSquares(potential, nx, ny, lattice.lo + vec2_t(0.5f * lattice.spacing), lattice.spacing, level, &ranges, {i0, j0}))
+                {
+                    visit(line);
+                }
+            }
+        }
+    };
+
+    // Appends numbers with two decimals, plenty for pixel coordinates
+    void appendNumber(std::string& text, float v)
+    {
+        char buffer[32];
+        auto result = std::to_chars(buffer, buffer + sizeof(buffer), v, std::chars_format::fixed, 2);
+        text.append(buffer, result.ptr);
+    }
+
+    // Shared by the SVG and PDF writers: output text collects in `text` and goes out in large writes
+    class text_sink_t
+    {
+    public:
+        bool open(const std::string& path, std::string& error)
+        {
+            out.open(path, std::ios::binary);
+            this->path = path;
+            if (!out)
+            {
+                error = "cannot write " + path;
+            }
+            return static_cast<bool>(out);
+        }
+
+    protected:
+        std::ofstream out;
+        std::string path, text;
+        size_t written = 0;
+
+        // Bytes output so far, pending text included
+        size_t position() const { return written + text.size(); }
+        void flush(bool force = false)
+        {
+            if (force || text.size() > (1 << 16))
+            {
+                out.write(text.data(), static_cast<std::streamsize>(text.size()));
+                written += text.size();
+                text.clear();
+            }
+        }
+
+        bool finish(std::string& error)
+        {
+            flush(true);
+            out.close();
+            if (!out)
+            {
+                error = "failed writing " + path;
+                return false;
+            }
+            return true;
+        }
+    };
+
+    class svg_writer_t : public text_sink_t
+    {
+    public:
+        void begin(int32_t width, int32_t height)
+        {
+            text += "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"" + std::to_string(width) + "\" height=\"" +
+                    std::to_string(height) + "\" viewBox=\"0 0 " + std::to_string(width) + " " + std::to_string(height) + "\">\n";
+            text += "<rect width=\"100%\" height=\"100%\" fill=\"#ffffff\"/>\n";
+        }
+        void stroke(color_t color, float width)
+        {
+            group("<g fill=\"none\" stroke-linejoin=\"round\" stroke-linecap=\"round\" stroke=\"" + hex(color) + "\" stroke-width=\"");
+            appendNumber(text, width);
+            text += "\">\n";
+        }
+        void fill(color_t color) { group("<g fill=\"" + hex(color) + "\">\n"); }
+        void polyline(std::span<const vec2_t> points)
+        {
+            text += "<polyline points=\"";
+            coordinates(points);
+            text += "\"/>\n";
+            flush();
+        }
+        void polygon(std::span<const vec2_t> points)
+        {
+            text += "<polygon points=\"";
+            coordinates(points);
+            text += "\"/>\n";
+            flush();
+        }
+        void rect(vec2_t corner, vec2_t size)
+        {
+            text += "<rect x=\"";
+            appendNumber(text, corner.x);
+            text += "\" y=\"";
+            appendNumber(text, corner.y);
+            text += "\" width=\"";
+            appendNumber(text, size.x);
+            text += "\" height=\"";
+            appendNumber(text, size.y);
+            text += "\"/>\n";
+            flush();
+        }
+        bool end(std::string& error)
+        {
+            group("");
+            text += "</svg>\n";
+            return finish(error);
+        }
+
+    private:
+        bool in_group = false;
+
+        static std::string hex(color_t c)
+        {
+            char buffer[8];
+            std::snprintf(buffer, sizeof(buffer), "#%02x%02x%02x", c.x, c.y, c.z);
+            return buffer;
+        }
+        void group(const std::string& opening)
+        {
+            if (in_group)
+            {
+                text += "</g>\n";
+            }
+            text += opening;
+            in_group = !opening.empty();
+        }
+        void coordinates(std::span<const vec2_t> points)
+        {
+            for (size_t i = 0; i < points.size(); i++)
+            {
+                if (i)
+                {
+                    text += ' ';
+                }
+                appendNumber(text, points[i].x);
+                text += ',';
+                appendNumber(text, points[i].y);
+            }
+        }
+    };
+
+    // A single page PDF with one uncompressed content stream. Its length is only known at the end,
+    // so it goes into an object of its own after the stream and the cross reference table comes last.
+    class pdf_writer_t : public text_sink_t
+    {
+    public:
+        void begin(int32_t width, int32_t height)
+        {
+            text += "%PDF-1.4\n";
+            object("<< /Type /Catalog /Pages 2 0 R >>");
+            object("<< /Type /Pages /Kids [3 0 R] /Count 1 >>");
+            object("<< /Type /Page /Parent 2 0 R /MediaBox [0 0 " + std::to_string(width) + " " + std::to_string(height) + "] /Contents 4 0 R >>");
+            offsets.push_back(position());
+            text += "4 0 obj\n<< /Length 5 0 R >>\nstream\n";
+            stream_start = position();
+            // Flip y so the page reads top down like the image
+            text += "1 0 0 -1 0 " + std::to_string(height) + " cm 1 j 1 J\n1 1 1 rg 0 0 " + std::to_string(width) + " " + std::to_string(height) + " re f\n";
+        }
+        void stroke(color_t color, float width)
+        {
+            rgb(color);
+            text += "RG ";
+            appendNumber(text, width);
+            text += " w\n";
+        }
+        void fill(color_t color)
+        {
+            rgb(color);
+            text += "rg\n";
+        }
+        void polyline(std::span<const vec2_t> points)
+        {
+            path(points);
+            text += "S\n";
+            flush();
+        }
+        void polygon(std::span<const vec2_t> points)
+        {
+            path(points);
+            text += "h f\n";
+            flush();
+        }
+        void rect(vec2_t corner, vec2_t size)
+        {
+            point(corner);
+            point(size);
+            text += "re f\n";
+            flush();
+        }
+        bool end(std::string& error)
+        {
+            size_t length = position() - stream_start;
+            text += "\nendstream\nendobj\n";
+            object(std::to_string(length));
+            size_t xref = position();
+            text += "xref\n0 " + std::to_string(offsets.size() + 1) + "\n0000000000 65535 f \n";
+            for (size_t offset : offsets)
+            {
+                char entry[24];
+                std::snprintf(entry, sizeof(entry), "%010zu 00000 n \n", offset);
+                text += entry;
+            }
+            text += "trailer\n<< /Size " + std::to_string(offsets.size() + 1) + " /Root 1 0 R >>\nstartxref\n" + std::to_string(xref) + "\n%%EOF\n";
+            return finish(error);
+        }
+
+    private:
+        std::vector<size_t> offsets;
+        size_t stream_start = 0;
+
+        void object(const std::string& body)
+        {
+            offsets.push_back(position());
+            text += std::to_string(offsets.size()) + " 0 obj\n" + body + "\nendobj\n";
+        }
+        void rgb(color_t c)
+        {
+            for (uint8_t v : {c.x, c.y, c.z})
+            {
+                appendNumber(text, v / 255.0f);
+                text += ' ';
+            }
+        }
+        void point(vec2_t p)
+        {
+            appendNumber(text, p.x);
+            text += ' ';
+            appendNumber(text, p.y);
+            text += ' ';
+        }
+        void path(std::span<const vec2_t> points)
+        {
+            for (size_t i = 0; i < points.size(); i++)
+            {
+                point(points[i]);
+                text += i ? "l " : "m ";
+            }
+        }
+    };
+
+    // Streams the drawing, in frame pixels, through an svg_writer_t or pdf_writer_t
+    template <typename writer_t>
+    bool writeVector(writer_t& writer, const geometry_t& geometry, const charges_t& charges, std::string& error)
+    {
+        const render_settings_t& settings = geometry.settings;
+        const canvas_t frame{{}, settings};
+        std::vector<vec2_t> points;
+        auto toPixels = [&](std::span<const vec2_t> line)
+        {
+            points.clear();
+            for (vec2_t p : line)
+            {
+                points.push_back(frame.toPixel(p));
+            }
+            return std::span<const vec2_t>(points);
+        };
+        writer.begin(settings.width, settings.height);
+
+        if (!geometry.levels.empty())
+        {
+            // In bands of lattice rows, so only one band of potentials is held at a time
+            writer.stroke(colors::green, 1.0f);
+            std::vector<float> potential;
+            constexpr int32_t band = 256;
+            for (int32_t j0 = 0; j0 < geometry.lattice.ny - 1; j0 += band)
+            {
+                geometry.equipotentials(0, geometry.lattice.nx - 1, j0, j0 + band, potential, [&](const polyline_t& line) { writer.polyline(toPixels(line)); });
+            }
+        }
+        writer.stroke(settings.line_color, 1.0f);
+        for (const field_line_t& line : geometry.lines)
+        {
+            // One polyline per visible run
+            size_t begin = 0;
+            for (size_t j = 1; j <= line.points.size(); j++)
+            {
+                if (j == line.points.size() || (settings.symmetry && !line.visible[j - 1]))
+                {
+                    if (j - begin >= 2)
+                    {
+                        writer.polyline(toPixels(std::span(line.points).subspan(begin, j - begin)));
+                    }
+                    begin = j;
+                }
+            }
+        }
+        writer.fill(colors::black);
+        for (auto [pos, dir] : geometry.arrows)
+        {
+            std::array<vec2_t, 3> head = arrowHead(frame.toPixel(pos), dir, static_cast<float>(settings.head_length), static_cast<float>(settings.head_thickness));
+            writer.polygon(head);
+        }
+        for (bool positive : {true, false})
+        {
+            writer.fill(positive ? colors::red : colors::blue);
+            for (size_t i = 0; i < charges.size(); i++)
+            {
+                if ((charges.strength[i] > 0) == positive)
+                {
+                    vec2_t q = glm::floor(frame.toPixel(charges.pos(i)));
+                    writer.rect(q - 1.0f, vec2_t(3.0f));
+                }
+            }
+        }
+        return writer.end(error);
+    }
+} // namespace
+
+bool exportPNG(const charges_t& charges, const render_settings_t& view, const std::string& path, std::string& error, int32_t tile, int level,
+               std::atomic<float>* progress, solver_t* solver)
+{
+    tile = std::max(tile, 16);
+    const geometry_t geometry(charges, view, solver);
+    const render_settings_t& settings = geometry.settings;
+    heatmap_t::range_t range;
+    if (settings.fieldcolor)
+    {
+        // Fitted to a preview of at most 512 pixels across, the percentiles barely move with the resolution
+        float shrink = std::max(1.0f, std::max(settings.width, settings.height) / 512.0f);
+        int32_t width = std::max(1, static_cast<int32_t>(settings.width / shrink));
+        int32_t height = std::max(1, static_cast<int32_t>(settings.height / shrink));
+        heatmap_t preview;
+        preview.quantity = settings.heat_quantity;
+        preview.scale = settings.heat_scale;
+        preview.colormap = settings.colormap;
+        std::vector<color_t> pixels(static_cast<size_t>(width) * height);
+        preview.render(geometry.solver, pixels, width, height, settings.origin, shrink / settings.zoom);
+        range = preview.lastRange();
+    }
+
+    // Sort everything drawn over the background into tiles, in drawing order
+    const int32_t tiles_x = (settings.width + tile - 1) / tile, tiles_y = (settings.height + tile - 1) / tile;
+    std::vector<std::vector<item_t>> bins(static_cast<size_t>(tiles_x) * tiles_y);
+    const canvas_t frame{{}, settings};
+    auto bin = [&](vec2_t lo, vec2_t hi, item_t item)
+    {
+        int32_t x_begin = std::max(0, static_cast<int32_t>(std::floor(lo.x / tile)));
+        int32_t x_end = std::min(tiles_x - 1, static_cast<int32_t>(std::floor(hi.x / tile)));
+        int32_t y_begin = std::max(0, static_cast<int32_t>(std::floor(lo.y / tile)));
+        int32_t y_end = std::min(tiles_y - 1, static_cast<int32_t>(std::floor(hi.y / tile)));
+        for (int32_t ty = y_begin; ty <= y_end; ty++)
+        {
+            for (int32_t tx = x_begin; tx <= x_end; tx++)
+            {
+                bins[static_cast<size_t>(ty) * tiles_x + tx].push_back(item);
+            }
+        }
+    };
+    const std::vector<field_line_t>& lines = geometry.lines;
+    for (uint32_t l = 0; l < lines.size(); l++)
+    {
+        for (uint32_t j = 1; j < lines[l].points.size(); j++)
+        {
+            if (!settings.symmetry || lines[l].visible[j - 1])
+            {
+                vec2_t a = frame.toPixel(lines[l].points[j - 1]), b = frame.toPixel(lines[l].points[j]);
+                bin(glm::min(a, b) - 1.0f, glm::max(a, b) + 1.0f, {item_t::segment, l, j});
+            }
+        }
+    }
+    float head = static_cast<float>(settings.head_length + settings.head_thickness);
+    for (uint32_t a = 0; a < geometry.arrows.size(); a++)
+    {
+        vec2_t q = frame.toPixel(geometry.arrows[a][0]);
+        bin(q - head, q + head, {item_t::arrow, a, 0});
+    }
+    for (uint32_t i = 0; i < charges.size(); i++)
+    {
+        vec2_t q = frame.toPixel(charges.pos(i));
+        bin(q - 2.0f, q + 2.0f, {item_t::charge, i, 0});
+    }
+
+    auto drawTile = [&](int32_t tx, int32_t ty, std::span<color_t> pixels, heatmap_t& heatmap, std::vector<float>& potential)
+    {
+        canvas_t canvas{pixels, settings, tx * tile, ty * tile, std::min(tile, settings.width - tx * tile), std::min(tile, settings.height - ty * tile)};
+        if (settings.fieldcolor)
+        {
+            heatmap.render(geometry.solver, pixels, canvas.width, canvas.height, settings.origin, 1.0f / settings.zoom, &range, {canvas.x0, canvas.y0});
+        }
+        else
+        {
+            std::ranges::fill(pixels, colors::white);
+        }
+        // Every cell that reaches into the tile, a line through a cell on the border comes out the same in both tiles
+        float cell = settings.equipotential_spacing;
+        geometry.equipotentials(static_cast<int32_t>(std::floor(canvas.x0 / cell)) - 2, static_cast<int32_t>(std::ceil((canvas.x0 + canvas.width) / cell)) + 1,
+                                static_cast<int32_t>(std::floor(canvas.y0 / cell)) - 2, static_cast<int32_t>(std::ceil((canvas.y0 + canvas.height) / cell)) + 1,
+                                potential,
+                                [&](const polyline_t& line)
+                                {
+                                    for (size_t k = 1; k < line.size(); k++)
+                                    {
+                                        canvas.drawLine(line[k - 1], line[k], colors::green);
+                                    }
+                                });
+        for (const item_t& item : bins[static_cast<size_t>(ty) * tiles_x + tx])
+        {
+            switch (item.kind)
+            {
+            case item_t::segment:
+                canvas.drawLine(lines[item.index].points[item.part - 1], lines[item.index].points[item.part], settings.line_color);
+                break;
+            case item_t::arrow:
+                canvas.drawArrow(geometry.arrows[item.index][0], geometry.arrows[item.index][1]);
+                break;
+            case item_t::charge:
+                canvas.drawCharge(charges[item.index]);
+                break;
+            }
+        }
+    };
+    png_writer_t png;
+    if (!png.open(path, settings.width, settings.height, level, error))
+    {
+        return false;
+    }
+    // Enough rows of tiles at once to keep every thread busy on narrow images, few enough to stay small on wide ones
+    int32_t band_tiles = std::max(1, std::min(static_cast<int32_t>(2 * pool().size() + tiles_x - 1) / tiles_x, (1 << 24) / (tile * tile * tiles_x)));
+    std::vector<color_t> band;
+    for (int32_t ty_begin = 0; ty_begin < tiles_y; ty_begin += band_tiles)
+    {
+        int32_t ty_end = std::min(tiles_y, ty_begin + band_tiles);
+        int32_t y_begin = ty_begin * tile, y_end = std::min(settings.height, ty_end * tile);
+        band.resize(static_cast<size_t>(y_end - y_begin) * settings.width);
+        parallelFor(static_cast<size_t>(ty_end - ty_begin) * tiles_x,
+                    [&](size_t begin, size_t end)
+                    {
+                        heatmap_t heatmap;
+                        heatmap.quantity = settings.heat_quantity;
+                        heatmap.scale = settings.heat_scale;
+                        heatmap.colormap = settings.colormap;
+                        std::vector<float> potential;
+                        std::vector<color_t> pixels;
+                        for (size_t t = begin; t < end; t++)
+                        {
+                            int32_t tx = static_cast<int32_t>(t % tiles_x), ty = ty_begin + static_cast<int32_t>(t / tiles_x);
+                            int32_t width = std::min(tile, settings.width - tx * tile), height = std::min(tile, settings.height - ty * tile);
+                            pixels.resize(static_cast<size_t>(width) * height);
+                            drawTile(tx, ty, pixels, heatmap, potential);
+                            for (int32_t y = 0; y < height; y++)
+                            {
+                                std::ranges::copy(std::span(pixels).subspan(static_cast<size_t>(y) * width, width),
+                                                  band.begin() + static_cast<size_t>(ty * tile + y - y_begin) * settings.width + tx * tile);
+                            }
+                        }
+                    });
+        if (!png.write(band, error))
+        {
+            return false;
+        }
+        if (progress)
+        {
+            *progress = static_cast<float>(y_end) / settings.height;
+        }
+    }
+    return png.close(error);
+}
+
+bool savePNG(std::span<const color_t> pixels, int32_t width, int32_t height, const std::string& path, std::string& error, int level,
+             std::atomic<float>* progress)
+{
+    if (pixels.size() != static_cast<size_t>(width) * height)
+    {
+        error = "image size does not match its pixels";
+        return false;
+    }
+    png_writer_t png;
+    if (!png.open(path, width, height, level, error))
+    {
+        return false;
+    }
+    const int32_t band_rows = 64;
+    for (int32_t y = 0; y < height; y += band_rows)
+    {
+        int32_t rows = std::min(band_rows, height - y);
+        if (!png.write(pixels.subspan(static_cast<size_t>(y) * width, static_cast<size_t>(rows) * width), error))
+        {
+            return false;
+        }
+        if (progress)
+        {
+            *progress = static_cast<float>(y + rows) / height;
+        }
+    }
+    return png.close(error);
+}
+
+bool exportVector(const charges_t& charges, const render_settings_t& view, const std::string& path, std::string& error, solver_t* solver)
+{
+    const geometry_t geometry(charges, view, solver);
+    if (path.ends_with(".pdf"))
+    {
+        pdf_writer_t pdf;
+        return pdf.open(path, error) && writeVector(pdf, geometry, charges, error);
+    }
+    svg_writer_t svg;
+    return svg.open(path, error) && writeVector(svg, geometry, charges, error);
+}
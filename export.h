@@ -0,0 +1,25 @@
+#pragma once
+#include "render.h"
+#include <atomic>
+#include <span>
+#include <string>
+
+// Renders the frame `settings` describes in square tiles of `tile` pixels and streams finished rows into
+// a PNG, so the image size is bounded by disk space instead of memory. Field lines are traced once for the
+// whole image and every tile draws its share of them, so they run on across tile borders without seams.
+// Equipotentials share one lattice and the heat map one color range over all tiles. The field grid is not
+// used, at export sizes it would be as large as the image. `level` is the zlib compression level.
+// `progress`, if given, is raised from 0 to 1 as rows are written. `solver`, if given, is prepared and used
+// instead of a fresh one, so exports of the same charges keep its tree and expansions.
+bool exportPNG(const charges_t& charges, const render_settings_t& settings, const std::string& path, std::string& error, int32_t tile = 256,
+               int level = 6, std::atomic<float>* progress = nullptr, solver_t* solver = nullptr);
+
+// Writes an image that is already rendered, `pixels` holding width * height colors row by row
+bool savePNG(std::span<const color_t> pixels, int32_t width, int32_t height, const std::string& path, std::string& error, int level = 6,
+             std::atomic<float>* progress = nullptr);
+
+// Writes field lines, equipotentials, arrow heads and charges as vector paths in frame pixel coordinates,
+// a PDF if `path` ends in .pdf and SVG otherwise. Everything is written out as it is produced, the
+// equipotentials one band of lattice rows at a time, so no pixel buffer is ever needed. The heat map is left out.
+// `solver` is reused as for exportPNG.
+bool exportVector(const charges_t& charges, const render_settings_t& settings, const std::string& path, std::string& error, solver_t* solver = nullptr);
@@ -0,0 +1,196 @@
+#include "export_queue.h"
+#include "export.h"
+#include "qoi.h"
+#include <algorithm>
+#include <new>
+#include <utility>
+
+export_queue_t::export_queue_t(std::function<void()> on_change)
+    : on_change(std::move(on_change)), workers(std::max(1u, std::thread::hardware_concurrency())), thread([this](std::stop_token stop) { loop(stop); })
+{
+}
+
+void export_queue_t::save(std::vector<color_t> pixels, int32_t width, int32_t height, const std::string& path, int level)
+{
+    {
+        std::lock_guard lock(mutex);
+        job_t& job = jobs.emplace_back();
+        job.path = path;
+        job.pixels = std::move(pixels);
+        job.width = width;
+        job.height = height;
+        job.level = level;
+    }
+    wake.notify_one();
+}
+
+void export_queue_t::render(const charges_t& charges, const render_settings_t& settings, const std::string& path, int level)
+{
+    {
+        std::lock_guard lock(mutex);
+        job_t& job = jobs.emplace_back();
+        job.path = path;
+        job.charges = charges;
+        job.settings = settings;
+        job.level = level;
+    }
+    wake.notify_one();
+}
+
+bool export_queue_t::record(std::span<const color_t> pixels, int32_t width, int32_t height, const std::string& path)
+{
+    {
+        std::lock_guard lock(mutex);
+        if (frame_counts.queued >= max_queued_frames)
+        {
+            frame_counts.dropped++;
+            return false;
+        }
+        // Holds the slot while the pixels are copied outside the lock
+        frame_counts.queued++;
+    }
+    std::vector<color_t> copy(pixels.begin(), pixels.end());
+    {
+        std::lock_guard lock(mutex);
+        job_t& job = jobs.emplace_back();
+        job.path = path;
+        job.pixels = std::move(copy);
+        job.width = width;
+        job.height = height;
+        job.frame = true;
+    }
+    wake.notify_one();
+    return true;
+}
+
+std::vector<export_queue_t::status_t> export_queue_t::status() const
+{
+    std::lock_guard lock(mutex);
+    std::vector<status_t> result;
+    for (const job_t& job : jobs)
+    {
+        if (job.frame)
+        {
+            continue;
+        }
+        result.push_back({job.path, job.state, job.progress.load(), job.error});
+    }
+    return result;
+}
+
+export_queue_t::frames_t export_queue_t::frames() const
+{
+    std::lock_guard lock(mutex);
+    return frame_counts;
+}
+
+void export_queue_t::clearFinished()
+{
+    std::lock_guard lock(mutex);
+    jobs.remove_if([](const job_t& job) { return job.state == state_t::done || job.state == state_t::failed; });
+    // Frames still waiting are not finished
+    frame_counts.written = frame_counts.failed = frame_counts.dropped = 0;
+    frame_counts.error.clear();
+}
+
+bool export_queue_t::busy() const
+{
+    std::lock_guard lock(mutex);
+    return std::ranges::any_of(jobs, [](const job_t& job) { return job.state == state_t::queued || job.state == state_t::writing; });
+}
+
+void export_queue_t::loop(std::stop_token stop)
+{
+    pool_scope_t scope(workers);
+    auto next = [this] { return std::ranges::find(jobs, state_t::queued, &job_t::state); };
+    while (true)
+    {
+        std::list<job_t>::iterator job;
+        {
+            std::unique_lock lock(mutex);
+            // Once stop is requested the wait returns whether a job is left, the ones left are dropped
+            if (!wake.wait(lock, stop, [&] { return next() != jobs.end(); }) || stop.stop_requested())
+            {
+                return;
+            }
+            job = next();
+            job->state = state_t::writing;
+        }
+        std::string error;
+        bool ok;
+        try
+        {
+            ok = write(*job, error);
+        }
+        catch (const std::bad_alloc&)
+        {
+            // Failing the one export beats taking the whole process down from this thread
+            ok = false;
+            error = "out of memory";
+        }
+        {
+            std::lock_guard lock(mutex);
+            if (job->frame)
+            {
+                frame_counts.queued--;
+                (ok ? frame_counts.written : frame_counts.failed)++;
+                if (!ok)
+                {
+                    frame_counts.error = std::move(error);
+                }
+                jobs.erase(job);
+            }
+            else
+            {
+                job->state = ok ? state_t::done : state_t::failed;
+                job->progress = 1;
+                job->error = std::move(error);
+                job->pixels = {};
+                job->charges = {};
+            }
+        }
+        if (on_change)
+        {
+            on_change();
+        }
+    }
+}
+
+bool export_queue_t::write(job_t& job, std::string& error)
+{
+    // Only this thread touches the pixels and the scene of a job once it is queued
+    bool ok;
+    if (job.path.ends_with(".qoi"))
+    {
+        // QOI is written from a whole image in memory, so a scene is rendered in one piece first
+        if (job.pixels.empty())
+        {
+            if (static_cast<size_t>(job.settings.width) * job.settings.height > max_qoi_pixels)
+            {
+                error = "too large for QOI, which is written from memory, export it as a PNG";
+                return false;
+            }
+            render_settings_t settings = job.settings;
+            settings.vector_lines = false;
+            renderer_t renderer;
+            job.width = settings.width;
+            job.height = settings.height;
+            job.pixels.resize(static_cast<size_t>(job.width) * job.height);
+            renderer.render(job.charges, settings, job.pixels);
+        }
+        ok = saveQOI(job.pixels, job.width, job.height, job.path, error);
+    }
+    else if (!job.pixels.empty())
+    {
+        ok = savePNG(job.pixels, job.width, job.height, job.path, error, job.level, &job.progress);
+    }
+    else if (job.path.ends_with(".svg") || job.path.ends_with(".pdf"))
+    {
+        ok = exportVector(job.charges, job.settings, job.path, error);
+    }
+    else
+    {
+        ok = exportPNG(job.charges, job.settings, job.path, error, 256, job.level, &job.progress);
+    }
+    return ok;
+}
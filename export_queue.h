@@ -0,0 +1,99 @@
+#pragma once
+#include "parallel.h"
+#include "render.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <span>
+#include <stop_token>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Writes images on a worker thread, one after another in the order they were queued, so the caller
+// pays for neither rendering nor compression. Tiles are rendered and blocks deflated on a pool owned by
+// the queue, so an export keeps every core even while the viewer renders on the shared one. On
+// destruction the export in progress is finished and the ones still waiting are dropped.
+class export_queue_t
+{
+public:
+    enum class state_t
+    {
+        queued,
+        writing,
+        done,
+        failed,
+    };
+
+    struct status_t
+    {
+        std::string path;
+        state_t state;
+        float progress;
+        std::string error;
+    };
+
+    // Frames of a recording are counted rather than listed, there is one per rendered frame
+    struct frames_t
+    {
+        size_t queued = 0, written = 0, failed = 0, dropped = 0;
+        // Why the last failed frame failed
+        std::string error;
+    };
+
+    // At 1080p a frame is 8 MB, a recording that falls further behind than this loses frames instead
+    static constexpr size_t max_queued_frames = 8;
+    // A QOI of a scene is rendered whole, in memory, so larger ones fail rather than take it all
+    static constexpr size_t max_qoi_pixels = size_t(1) << 28;
+
+    // on_change is called from the worker whenever an export finishes
+    explicit export_queue_t(std::function<void()> on_change = {});
+
+    // Saves pixels that are already rendered, width * height colors row by row, as QOI for .qoi paths and PNG otherwise.
+    // level is the zlib compression level of PNGs.
+    void save(std::vector<color_t> pixels, int32_t width, int32_t height, const std::string& path, int level = 6);
+    // Renders the scene on the worker first, a PDF or SVG for .pdf and .svg paths, a QOI for .qoi and a tiled PNG otherwise
+    void render(const charges_t& charges, const render_settings_t& settings, const std::string& path, int level = 6);
+    // Queues a copy of a frame of a recording like save(), unless max_queued_frames are still waiting, in
+    // which case the frame is dropped and false returned. Written frames leave the queue right away.
+    bool record(std::span<const color_t> pixels, int32_t width, int32_t height, const std::string& path);
+    // Every export still known, oldest first, without the frames of a recording
+    std::vector<status_t> status() const;
+    frames_t frames() const;
+    // Forgets the exports that are done or failed and the frame counts
+    void clearFinished();
+    // Whether an export is waiting or being written
+    bool busy() const;
+
+private:
+    struct job_t
+    {
+        std::string path;
+        // Empty when the image is rendered from the charges and settings
+        std::vector<color_t> pixels;
+        int32_t width = 0, height = 0;
+        int level = 6;
+        charges_t charges;
+        render_settings_t settings;
+        bool frame = false;
+        state_t state = state_t::queued;
+        std::atomic<float> progress = 0;
+        std::string error;
+    };
+
+    mutable std::mutex mutex;
+    std::condition_variable_any wake;
+    // A list so the job being written stays put while others are queued or cleared
+    std::list<job_t> jobs;
+    frames_t frame_counts;
+    std::function<void()> on_change;
+    thread_pool_t workers;
+    // Declared last so the worker starts after, and is stopped and joined before, everything it uses
+    std::jthread thread;
+
+    void loop(std::stop_token stop);
+    bool write(job_t& job, std::string& error);
+};
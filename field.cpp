@@ -0,0 +1,480 @@
+#include "field.h"
+#include <cmath>
+#include <utility>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define GAUSS_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(GAUSS_X86) && (defined(__GNUC__) || defined(__clang__))
+#define TARGET_AVX2 __attribute__((target("avx2,fma")))
+#else
+#define TARGET_AVX2
+#endif
+
+namespace
+{
+    // Adds the contribution of charges [begin, end) to sum, returns false if p is exactly on one of them
+    bool accumulate(const charges_t& charges, size_t begin, size_t end, vec2_t p, vec2_t& sum)
+    {
+        for (size_t i = begin; i < end; i++)
+        {
+            float dx = p.x - charges.x[i], dy = p.y - charges.y[i];
+            float r2 = dx * dx + dy * dy;
+            if (r2 == 0.0f)
+            {
+                return false;
+            }
+            float inv = 1.0f / std::sqrt(r2);
+            float s = charges.strength[i] * inv * inv * inv;
+            sum.x += s * dx;
+            sum.y += s * dy;
+        }
+        return true;
+    }
+
+    // Potential of charges [begin, end) at p added to sum, returns false if p is exactly on one of them
+    bool accumulatePotential(const charges_t& charges, size_t begin, size_t end, vec2_t p, float& sum)
+    {
+        for (size_t i = begin; i < end; i++)
+        {
+            float dx = p.x - charges.x[i], dy = p.y - charges.y[i];
+            float r2 = dx * dx + dy * dy;
+            if (r2 == 0.0f)
+            {
+                return false;
+            }
+            sum += charges.strength[i] / std::sqrt(r2);
+        }
+        return true;
+    }
+
+    float potentialAtScalar(const charges_t& charges, vec2_t p)
+    {
+        float sum = 0;
+        return accumulatePotential(charges, 0, charges.size(), p, sum) ? k * sum : 0.0f;
+    }
+
+    [[maybe_unused]] void potentialAtScalar(const charges_t& charges, std::span<const vec2_t> points, std::span<float> potentials)
+    {
+        for (size_t j = 0; j < points.size(); j++)
+        {
+            potentials[j] = potentialAtScalar(charges, points[j]);
+        }
+    }
+
+    [[maybe_unused]] void forceAtScalar(const charges_t& charges, std::span<const vec2_t> points, std::span<vec2_t> forces)
+    {
+        for (size_t j = 0; j < points.size(); j++)
+        {
+            vec2_t sum(0.0f);
+            forces[j] = accumulate(charges, 0, charges.size(), points[j], sum) ? k * sum : vec2_t(0.0f);
+        }
+    }
+
+#ifdef GAUSS_X86
+    // 1/r^3 from r^2, the hardware estimate refined with one newton step
+    inline __m128 invCube(__m128 r2)
+    {
+        __m128 r = _mm_rsqrt_ps(r2);
+        r = _mm_mul_ps(r, _mm_sub_ps(_mm_set1_ps(1.5f), _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(0.5f), r2), _mm_mul_ps(r, r))));
+        return _mm_mul_ps(_mm_mul_ps(r, r), r);
+    }
+
+    inline float horizontalSum(__m128 v)
+    {
+        __m128 shuf = _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1));
+        __m128 sums = _mm_add_ps(v, shuf);
+        shuf = _mm_movehl_ps(shuf, sums);
+        return _mm_cvtss_f32(_mm_add_ss(sums, shuf));
+    }
+
+    inline __m128 invSqrt(__m128 r2)
+    {
+        __m128 r = _mm_rsqrt_ps(r2);
+        return _mm_mul_ps(r, _mm_sub_ps(_mm_set1_ps(1.5f), _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(0.5f), r2), _mm_mul_ps(r, r))));
+    }
+
+    // One point against 4 charges per instruction
+    vec2_t forceAtSse2(const charges_t& charges, vec2_t p)
+    {
+        const size_t n = charges.size();
+        __m128 x = _mm_set1_ps(p.x), y = _mm_set1_ps(p.y);
+        __m128 sx = _mm_setzero_ps(), sy = _mm_setzero_ps(), hit = _mm_setzero_ps();
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4)
+        {
+            __m128 dx = _mm_sub_ps(x, _mm_loadu_ps(charges.x.data() + i));
+            __m128 dy = _mm_sub_ps(y, _mm_loadu_ps(charges.y.data() + i));
+            __m128 r2 = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+            hit = _mm_or_ps(hit, _mm_cmpeq_ps(r2, _mm_setzero_ps()));
+            __m128 s = _mm_mul_ps(_mm_loadu_ps(charges.strength.data() + i), invCube(r2));
+            sx = _mm_add_ps(sx, _mm_mul_ps(s, dx));
+            sy = _mm_add_ps(sy, _mm_mul_ps(s, dy));
+        }
+        vec2_t sum(horizontalSum(sx), horizontalSum(sy));
+        if (_mm_movemask_ps(hit) || !accumulate(charges, i, n, p, sum))
+        {
+            return vec2_t(0.0f);
+        }
+        return k * sum;
+    }
+
+    // Blocks of 4 points against one charge per instruction, leftover points go through forceAtSse2
+    void forceAtSse2(const charges_t& charges, std::span<const vec2_t> points, std::span<vec2_t> forces)
+    {
+        const size_t n = charges.size();
+        size_t j = 0;
+        for (; j + 4 <= points.size(); j += 4)
+        {
+            __m128 x = _mm_setr_ps(points[j].x, points[j + 1].x, points[j + 2].x, points[j + 3].x);
+            __m128 y = _mm_setr_ps(points[j].y, points[j + 1].y, points[j + 2].y, points[j + 3].y);
+            __m128 sx = _mm_setzero_ps(), sy = _mm_setzero_ps(), hit = _mm_setzero_ps();
+            for (size_t i = 0; i < n; i++)
+            {
+                __m128 dx = _mm_sub_ps(x, _mm_set1_ps(charges.x[i]));
+                __m128 dy = _mm_sub_ps(y, _mm_set1_ps(charges.y[i]));
+                __m128 r2 = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+                hit = _mm_or_ps(hit, _mm_cmpeq_ps(r2, _mm_setzero_ps()));
+                __m128 s = _mm_mul_ps(_mm_set1_ps(charges.strength[i]), invCube(r2));
+                sx = _mm_add_ps(sx, _mm_mul_ps(s, dx));
+                sy = _mm_add_ps(sy, _mm_mul_ps(s, dy));
+            }
+            alignas(16) float fx[4], fy[4];
+            _mm_store_ps(fx, _mm_andnot_ps(hit, _mm_mul_ps(sx, _mm_set1_ps(k))));
+            _mm_store_ps(fy, _mm_andnot_ps(hit, _mm_mul_ps(sy, _mm_set1_ps(k))));
+            for (size_t l = 0; l < 4; l++)
+            {
+                forces[j + l] = vec2_t(fx[l], fy[l]);
+            }
+        }
+        for (; j < points.size(); j++)
+        {
+            forces[j] = forceAtSse2(charges, points[j]);
+        }
+    }
+
+    // Blocks of 4 points against one charge per instruction
+    void potentialAtSse2(const charges_t& charges, std::span<const vec2_t> points, std::span<float> potentials)
+    {
+        const size_t n = charges.size();
+        size_t j = 0;
+        for (; j + 4 <= points.size(); j += 4)
+        {
+            __m128 x = _mm_setr_ps(points[j].x, points[j + 1].x, points[j + 2].x, points[j + 3].x);
+            __m128 y = _mm_setr_ps(points[j].y, points[j + 1].y, points[j + 2].y, points[j + 3].y);
+            __m128 sum = _mm_setzero_ps(), hit = _mm_setzero_ps();
+            for (size_t i = 0; i < n; i++)
+            {
+                __m128 dx = _mm_sub_ps(x, _mm_set1_ps(charges.x[i]));
+                __m128 dy = _mm_sub_ps(y, _mm_set1_ps(charges.y[i]));
+                __m128 r2 = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+                hit = _mm_or_ps(hit, _mm_cmpeq_ps(r2, _mm_setzero_ps()));
+                sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(charges.strength[i]), invSqrt(r2)));
+            }
+            _mm_storeu_ps(potentials.data() + j, _mm_andnot_ps(hit, _mm_mul_ps(sum, _mm_set1_ps(k))));
+        }
+        for (; j < points.size(); j++)
+        {
+            potentials[j] = potentialAtScalar(charges, points[j]);
+        }
+    }
+
+    TARGET_AVX2 inline __m256 invCube(__m256 r2)
+    {
+        __m256 r = _mm256_rsqrt_ps(r2);
+        r = _mm256_mul_ps(r, _mm256_fnmadd_ps(_mm256_mul_ps(_mm256_set1_ps(0.5f), r2), _mm256_mul_ps(r, r), _mm256_set1_ps(1.5f)));
+        return _mm256_mul_ps(_mm256_mul_ps(r, r), r);
+    }
+
+    TARGET_AVX2 inline __m256 invSqrt(__m256 r2)
+    {
+        __m256 r = _mm256_rsqrt_ps(r2);
+        return _mm256_mul_ps(r, _mm256_fnmadd_ps(_mm256_mul_ps(_mm256_set1_ps(0.5f), r2), _mm256_mul_ps(r, r), _mm256_set1_ps(1.5f)));
+    }
+
+    TARGET_AVX2 inline float horizontalSum(__m256 v)
+    {
+        __m128 lo = _mm256_castps256_ps128(v), hi = _mm256_extractf128_ps(v, 1);
+        return horizontalSum(_mm_add_ps(lo, hi));
+    }
+
+    // One point against 8 charges per instruction
+    TARGET_AVX2 vec2_t forceAtAvx2(const charges_t& charges, vec2_t p)
+    {
+        const size_t n = charges.size();
+        __m256 x = _mm256_set1_ps(p.x), y = _mm256_set1_ps(p.y);
+        __m256 sx = _mm256_setzero_ps(), sy = _mm256_setzero_ps(), hit = _mm256_setzero_ps();
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8)
+        {
+            __m256 dx = _mm256_sub_ps(x, _mm256_loadu_ps(charges.x.data() + i));
+            __m256 dy = _mm256_sub_ps(y, _mm256_loadu_ps(charges.y.data() + i));
+            __m256 r2 = _mm256_fmadd_ps(dx, dx, _mm256_mul_ps(dy, dy));
+            hit = _mm256_or_ps(hit, _mm256_cmp_ps(r2, _mm256_setzero_ps(), _CMP_EQ_OQ));
+            __m256 s = _mm256_mul_ps(_mm256_loadu_ps(charges.strength.data() + i), invCube(r2));
+            sx = _mm256_fmadd_ps(s, dx, sx);
+            sy = _mm256_fmadd_ps(s, dy, sy);
+        }
+        vec2_t sum(horizontalSum(sx), horizontalSum(sy));
+        if (_mm256_movemask_ps(hit) || !accumulate(charges, i, n, p, sum))
+        {
+            return vec2_t(0.0f);
+        }
+        return k * sum;
+    }
+
+    // Blocks of 8 points against one charge per instruction, leftover points go through forceAtAvx2
+    TARGET_AVX2 void forceAtAvx2(const charges_t& charges, std::span<const vec2_t> points, std::span<vec2_t> forces)
+    {
+        const size_t n = charges.size();
+        size_t j = 0;
+        for (; j + 8 <= points.size(); j += 8)
+        {
+            alignas(32) float px[8], py[8];
+            for (size_t l = 0; l < 8; l++)
+            {
+                px[l] = points[j + l].x;
+                py[l] = points[j + l].y;
+            }
+            __m256 x = _mm256_load_ps(px), y = _mm256_load_ps(py);
+            __m256 sx = _mm256_setzero_ps(), sy = _mm256_setzero_ps(), hit = _mm256_setzero_ps();
+            for (size_t i = 0; i < n; i++)
+            {
+                __m256 dx = _mm256_sub_ps(x, _mm256_broadcast_ss(charges.x.data() + i));
+                __m256 dy = _mm256_sub_ps(y, _mm256_broadcast_ss(charges.y.data() + i));
+                __m256 r2 = _mm256_fmadd_ps(dx, dx, _mm256_mul_ps(dy, dy));
+                hit = _mm256_or_ps(hit, _mm256_cmp_ps(r2, _mm256_setzero_ps(), _CMP_EQ_OQ));
+                __m256 s = _mm256_mul_ps(_mm256_broadcast_ss(charges.strength.data() + i), invCube(r2));
+                sx = _mm256_fmadd_ps(s, dx, sx);
+                sy = _mm256_fmadd_ps(s, dy, sy);
+            }
+            _mm256_store_ps(px, _mm256_andnot_ps(hit, _mm256_mul_ps(sx, _mm256_set1_ps(k))));
+            _mm256_store_ps(py, _mm256_andnot_ps(hit, _mm256_mul_ps(sy, _mm256_set1_ps(k))));
+            for (size_t l = 0; l < 8; l++)
+            {
+                forces[j + l] = vec2_t(px[l], py[l]);
+            }
+        }
+        for (; j < points.size(); j++)
+        {
+            forces[j] = forceAtAvx2(charges, points[j]);
+        }
+    }
+
+    // Blocks of 8 points against one charge per instruction
+    TARGET_AVX2 void potentialAtAvx2(const charges_t& charges, std::span<const vec2_t> points, std::span<float> potentials)
+    {
+        const size_t n = charges.size();
+        size_t j = 0;
+        for (; j + 8 <= points.size(); j += 8)
+        {
+            alignas(32) float px[8], py[8];
+            for (size_t l = 0; l < 8; l++)
+            {
+                px[l] = points[j + l].x;
+                py[l] = points[j + l].y;
+            }
+            __m256 x = _mm256_load_ps(px), y = _mm256_load_ps(py);
+            __m256 sum = _mm256_setzero_ps(), hit = _mm256_setzero_ps();
+            for (size_t i = 0; i < n; i++)
+            {
+                __m256 dx = _mm256_sub_ps(x, _mm256_broadcast_ss(charges.x.data() + i));
+                __m256 dy = _mm256_sub_ps(y, _mm256_broadcast_ss(charges.y.data() + i));
+                __m256 r2 = _mm256_fmadd_ps(dx, dx, _mm256_mul_ps(dy, dy));
+                hit = _mm256_or_ps(hit, _mm256_cmp_ps(r2, _mm256_setzero_ps(), _CMP_EQ_OQ));
+                sum = _mm256_fmadd_ps(_mm256_broadcast_ss(charges.strength.data() + i), invSqrt(r2), sum);
+            }
+            _mm256_storeu_ps(potentials.data() + j, _mm256_andnot_ps(hit, _mm256_mul_ps(sum, _mm256_set1_ps(k))));
+        }
+        for (; j < points.size(); j++)
+        {
+            potentials[j] = potentialAtScalar(charges, points[j]);
+        }
+    }
+
+    bool cpuHasAvx2()
+    {
+#if defined(_MSC_VER)
+        int info[4];
+        __cpuid(info, 0);
+        if (info[0] < 7)
+        {
+            return false;
+        }
+        __cpuid(info, 1);
+        bool fma = info[2] & (1 << 12), osxsave = info[2] & (1 << 27);
+        if (!fma || !osxsave || (_xgetbv(0) & 6) != 6)
+        {
+            return false;
+        }
+        __cpuidex(info, 7, 0);
+        return info[1] & (1 << 5);
+#else
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+    }
+#endif
+
+    struct kernel_t
+    {
+        const char* name;
+        void (*batch)(const charges_t&, std::span<const vec2_t>, std::span<vec2_t>);
+        vec2_t (*single)(const charges_t&, vec2_t);
+        void (*potential)(const charges_t&, std::span<const vec2_t>, std::span<float>);
+    };
+
+    kernel_t selectKernel()
+    {
+#ifdef GAUSS_X86
+        if (cpuHasAvx2())
+        {
+            return {"avx2", forceAtAvx2, forceAtAvx2, potentialAtAvx2};
+        }
+        return {"sse2", forceAtSse2, forceAtSse2, potentialAtSse2};
+#else
+        return {"scalar", forceAtScalar,
+                [](const charges_t& charges, vec2_t p)
+                {
+                    vec2_t force;
+                    forceAtScalar(charges, {&p, 1}, {&force, 1});
+                    return force;
+                },
+                potentialAtScalar};
+#endif
+    }
+
+    const kernel_t kernel = selectKernel();
+} // namespace
+
+charges_t::charges_t(std::initializer_list<charge_t> init)
+{
+    reserve(init.size());
+    for (charge_t c : init)
+    {
+        add(c);
+    }
+}
+
+charges_t::charges_t(const charges_t& other)
+    : version(other.version), owned_x(other.x.begin(), other.x.end()), owned_y(other.y.begin(), other.y.end()),
+      owned_strength(other.strength.begin(), other.strength.end())
+{
+    point();
+}
+
+charges_t::charges_t(charges_t&& other) noexcept
+    : x(std::exchange(other.x, {})), y(std::exchange(other.y, {})), strength(std::exchange(other.strength, {})), version(other.version),
+      owned_x(std::move(other.owned_x)), owned_y(std::move(other.owned_y)), owned_strength(std::move(other.owned_strength)), storage(std::move(other.storage))
+{
+}
+
+charges_t& charges_t::operator=(const charges_t& other)
+{
+    if (this != &other)
+    {
+        owned_x.assign(other.x.begin(), other.x.end());
+        owned_y.assign(other.y.begin(), other.y.end());
+        owned_strength.assign(other.strength.begin(), other.strength.end());
+        storage.reset();
+        point();
+        version = other.version;
+    }
+    return *this;
+}
+
+charges_t& charges_t::operator=(charges_t&& other) noexcept
+{
+    if (this != &other)
+    {
+        owned_x = std::move(other.owned_x);
+        owned_y = std::move(other.owned_y);
+        owned_strength = std::move(other.owned_strength);
+        storage = std::move(other.storage);
+        x = std::exchange(other.x, {});
+        y = std::exchange(other.y, {});
+        strength = std::exchange(other.strength, {});
+        version = other.version;
+    }
+    return *this;
+}
+
+charges_t charges_t::borrow(std::span<float> x, std::span<float> y, std::span<float> strength, std::shared_ptr<void> storage)
+{
+    charges_t charges;
+    charges.x = x;
+    charges.y = y;
+    charges.strength = strength;
+    charges.storage = std::move(storage);
+    charges.touch();
+    return charges;
+}
+
+void charges_t::own()
+{
+    if (storage)
+    {
+        owned_x.assign(x.begin(), x.end());
+        owned_y.assign(y.begin(), y.end());
+        owned_strength.assign(strength.begin(), strength.end());
+        storage.reset();
+    }
+}
+
+void charges_t::reserve(size_t n)
+{
+    own();
+    owned_x.reserve(n);
+    owned_y.reserve(n);
+    owned_strength.reserve(n);
+    point();
+}
+
+void charges_t::add(charge_t c)
+{
+    own();
+    owned_x.push_back(c.pos.x);
+    owned_y.push_back(c.pos.y);
+    owned_strength.push_back(c.strength);
+    point();
+    touch();
+}
+
+void charges_t::remove(size_t i)
+{
+    own();
+    owned_x.erase(owned_x.begin() + i);
+    owned_y.erase(owned_y.begin() + i);
+    owned_strength.erase(owned_strength.begin() + i);
+    point();
+    touch();
+}
+
+void forceAt(const charges_t& charges, std::span<const vec2_t> points, std::span<vec2_t> forces)
+{
+    kernel.batch(charges, points, forces);
+}
+
+vec2_t forceAt(const charges_t& charges, vec2_t p)
+{
+    return kernel.single(charges, p);
+}
+
+void potentialAt(const charges_t& charges, std::span<const vec2_t> points, std::span<float> potentials)
+{
+    kernel.potential(charges, points, potentials);
+}
+
+float potentialAt(const charges_t& charges, vec2_t p)
+{
+    return potentialAtScalar(charges, p);
+}
+
+const char* forceKernelName()
+{
+    return kernel.name;
+}
@@ -0,0 +1,76 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <initializer_list>
+#include <memory>
+#include <numbers>
+#include <span>
+#include <vector>
+
+using vec2_t = glm::vec<2, float>;
+
+constexpr float e0 = 8.8541878128E-12;
+constexpr float k = 1 / (4 * std::numbers::pi * e0);
+
+struct charge_t
+{
+    vec2_t pos;
+    float strength;
+};
+
+// Structure-of-arrays charge storage, x, y and strength each live in their own contiguous array.
+// The arrays are either owned or borrowed from memory that `storage` keeps alive, such as a mapped
+// scene file. Values can be edited in place either way, adding or removing charges first copies
+// borrowed arrays into owned ones. Copies always own their arrays.
+struct charges_t
+{
+    std::span<float> x, y, strength;
+    // Renewed on every change so cached structures built from the charges know when to update.
+    // Versions come from one counter shared by every charge set, so a cache handed a different set
+    // never mistakes it for the one it was built from. Copies keep the version, their content matches.
+    uint64_t version = 0;
+
+    charges_t() = default;
+    charges_t(std::initializer_list<charge_t> init);
+    charges_t(const charges_t& other);
+    charges_t(charges_t&& other) noexcept;
+    charges_t& operator=(const charges_t& other);
+    charges_t& operator=(charges_t&& other) noexcept;
+
+    // Uses the three arrays without copying them, they must stay valid as long as `storage` lives
+    static charges_t borrow(std::span<float> x, std::span<float> y, std::span<float> strength, std::shared_ptr<void> storage);
+    bool borrowed() const { return storage != nullptr; }
+
+    size_t size() const { return strength.size(); }
+    bool empty() const { return strength.empty(); }
+    vec2_t pos(size_t i) const { return {x[i], y[i]}; }
+    charge_t operator[](size_t i) const { return {pos(i), strength[i]}; }
+    void touch() { version = ++last_version; }
+
+    void reserve(size_t n);
+    void add(charge_t c);
+    void remove(size_t i);
+
+private:
+    std::vector<float> owned_x, owned_y, owned_strength;
+    std::shared_ptr<void> storage;
+
+    static inline std::atomic<uint64_t> last_version = 0;
+
+    // Copies borrowed arrays into owned ones so they can grow
+    void own();
+    void point() { x = owned_x, y = owned_y, strength = owned_strength; }
+};
+
+// Field at every point of `points`, written to the matching entry of `forces`.
+// A point that sits exactly on a charge gets a zero field.
+void forceAt(const charges_t& charges, std::span<const vec2_t> points, std::span<vec2_t> forces);
+vec2_t forceAt(const charges_t& charges, vec2_t p);
+
+// Electric potential k * sum q / r, zero on top of a charge like the field
+void potentialAt(const charges_t& charges, std::span<const vec2_t> points, std::span<float> potentials);
+float potentialAt(const charges_t& charges, vec2_t p);
+
+// Name of the kernel picked for this cpu ("avx2", "sse2" or "scalar")
+const char* forceKernelName();
@@ -0,0 +1,88 @@
+#include "field_grid.h"
+#include "parallel.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+namespace
+{
+    // Catmull-Rom weights for the samples at -1, 0, 1, 2 around t in [0, 1)
+    void cubicWeights(float t, float w[4])
+    {
+        float t2 = t * t, t3 = t2 * t;
+        w[0] = 0.5f * (-t3 + 2 * t2 - t);
+        w[1] = 0.5f * (3 * t3 - 5 * t2 + 2);
+        w[2] = 0.5f * (-3 * t3 + 4 * t2 + t);
+        w[3] = 0.5f * (t3 - t2);
+    }
+} // namespace
+
+bool field_grid_t::stale(uint64_t version, uint64_t source, float spacing, vec2_t lo, vec2_t hi) const
+{
+    return version != built_version || source != built_source || spacing != this->spacing || lo != this->lo || hi != this->hi;
+}
+
+void field_grid_t::build(uint64_t version, uint64_t source, float spacing, vec2_t lo, vec2_t hi, const evaluator_t& evaluate)
+{
+    auto start = std::chrono::steady_clock::now();
+    built_version = version;
+    built_source = source;
+    this->spacing = spacing;
+    this->lo = lo;
+    this->hi = hi;
+    nx = std::max(2, static_cast<int32_t>(std::ceil((hi.x - lo.x) / spacing)) + 1);
+    ny = std::max(2, static_cast<int32_t>(std::ceil((hi.y - lo.y) / spacing)) + 1);
+    nodes.resize(static_cast<size_t>(nx) * ny);
+    parallelFor(ny,
+                [&](size_t begin, size_t end)
+                {
+                    std::vector<vec2_t> row(nx);
+                    for (size_t j = begin; j < end; j++)
+                    {
+                        for (int32_t i = 0; i < nx; i++)
+                        {
+                            row[i] = lo + spacing * vec2_t(i, j);
+                        }
+                        evaluate(row, std::span(nodes).subspan(j * nx, nx));
+                    }
+                });
+    build_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+bool field_grid_t::contains(vec2_t p) const
+{
+    return !nodes.empty() && p.x >= lo.x && p.y >= lo.y && p.x <= lo.x + (nx - 1) * spacing && p.y <= lo.y + (ny - 1) * spacing;
+}
+
+vec2_t field_grid_t::at(int32_t i, int32_t j) const
+{
+    return nodes[static_cast<size_t>(std::clamp(j, 0, ny - 1)) * nx + std::clamp(i, 0, nx - 1)];
+}
+
+vec2_t field_grid_t::sample(vec2_t p, interpolation_t mode) const
+{
+    vec2_t f = (p - lo) / spacing;
+    int32_t i = std::clamp(static_cast<int32_t>(std::floor(f.x)), 0, nx - 2);
+    int32_t j = std::clamp(static_cast<int32_t>(std::floor(f.y)), 0, ny - 2);
+    float tx = f.x - i, ty = f.y - j;
+    if (mode == interpolation_t::bilinear)
+    {
+        vec2_t bottom = (1 - tx) * at(i, j) + tx * at(i + 1, j);
+        vec2_t top = (1 - tx) * at(i, j + 1) + tx * at(i + 1, j + 1);
+        return (1 - ty) * bottom + ty * top;
+    }
+    float wx[4], wy[4];
+    cubicWeights(tx, wx);
+    cubicWeights(ty, wy);
+    vec2_t sum(0.0f);
+    for (int32_t b = 0; b < 4; b++)
+    {
+        vec2_t row(0.0f);
+        for (int32_t a = 0; a < 4; a++)
+        {
+            row += wx[a] * at(i + a - 1, j + b - 1);
+        }
+        sum += wy[b] * row;
+    }
+    return sum;
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include "field.h"
+#include <cstdint>
+#include <functional>
+#include <span>
+#include <vector>
+
+enum class interpolation_t
+{
+    bilinear,
+    bicubic,
+};
+
+inline const char* interpolation_names[] = {"Bilinear", "Bicubic"};
+
+// Field vectors sampled on a regular lattice so tracers can interpolate instead of summing every charge
+class field_grid_t
+{
+public:
+    using evaluator_t = std::function<void(std::span<const vec2_t>, std::span<vec2_t>)>;
+
+    // `source` identifies whatever produced the values besides the charges (solver method and settings)
+    bool stale(uint64_t version, uint64_t source, float spacing, vec2_t lo, vec2_t hi) const;
+    // Evaluates every node row by row on the thread pool
+    void build(uint64_t version, uint64_t source, float spacing, vec2_t lo, vec2_t hi, const evaluator_t& evaluate);
+
+    bool contains(vec2_t p) const;
+    vec2_t sample(vec2_t p, interpolation_t mode) const;
+
+    int32_t width() const { return nx; }
+    int32_t height() const { return ny; }
+    double buildMilliseconds() const { return build_ms; }
+
+private:
+    uint64_t built_version = ~uint64_t(0), built_source = 0;
+    float spacing = 0;
+    vec2_t lo, hi;
+    int32_t nx = 0, ny = 0;
+    std::vector<vec2_t> nodes;
+    double build_ms = 0;
+
+    vec2_t at(int32_t i, int32_t j) const;
+};
@@ -0,0 +1,524 @@
+#include "fmm.h"
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <random>
+
+namespace
+{
+    constexpr size_t termCount(int32_t order) { return static_cast<size_t>((order + 1) * (order + 2) / 2); }
+    // Terms are ordered by total degree, (a, b) is the coefficient of x^a y^b
+    constexpr size_t termIndex(int32_t a, int32_t b)
+    {
+        int32_t n = a + b;
+        return static_cast<size_t>(n * (n + 1) / 2 + b);
+    }
+
+    struct binomials_t
+    {
+        std::array<std::array<double, 2 * fmm_t::max_order + 2>, 2 * fmm_t::max_order + 2> c{};
+        constexpr binomials_t()
+        {
+            for (size_t n = 0; n < c.size(); n++)
+            {
+                c[n][0] = 1;
+                for (size_t k = 1; k <= n; k++)
+                {
+                    c[n][k] = c[n - 1][k - 1] + (k < n ? c[n - 1][k] : 0);
+                }
+            }
+        }
+        double operator()(int32_t n, int32_t k) const { return c[n][k]; }
+    };
+    constexpr binomials_t binomial;
+
+    // Taylor coefficients T_(a,b)(r) = 1 / (a! b!) d^a/dx^a d^b/dy^b 1/|r| for a + b <= order, from the
+    // recurrence |r|^2 n T_k + (2n - 1) sum_i r_i T_(k - e_i) + (n - 1) sum_i T_(k - 2 e_i) = 0, n = |k|
+    void derivatives(double rx, double ry, int32_t order, double* t)
+    {
+        double r2 = rx * rx + ry * ry;
+        t[0] = 1.0 / std::sqrt(r2);
+        for (int32_t n = 1; n <= order; n++)
+        {
+            for (int32_t b = 0; b <= n; b++)
+            {
+                int32_t a = n - b;
+                double first = 0, second = 0;
+                if (a >= 1)
+                {
+                    first += rx * t[termIndex(a - 1, b)];
+                }
+                if (b >= 1)
+                {
+                    first += ry * t[termIndex(a, b - 1)];
+                }
+                if (a >= 2)
+                {
+                    second += t[termIndex(a - 2, b)];
+                }
+                if (b >= 2)
+                {
+                    second += t[termIndex(a, b - 2)];
+                }
+                t[termIndex(a, b)] = -((2 * n - 1) * first + (n - 1) * second) / (n * r2);
+            }
+        }
+    }
+
+    void powers(double v, int32_t order, double* out)
+    {
+        out[0] = 1;
+        for (int32_t i = 1; i <= order; i++)
+        {
+            out[i] = out[i - 1] * v;
+        }
+    }
+} // namespace
+
+size_t fmm_t::terms() const
+{
+    return termCount(built_order);
+}
+
+vec2_t fmm_t::boxCenter(int32_t level, int32_t i, int32_t j) const
+{
+    double h = boxSize(level);
+    return vec2_t(origin.x + (i + 0.5) * h, origin.y + (j + 0.5) * h);
+}
+
+bool fmm_t::leafOf(vec2_t p, int32_t& i, int32_t& j) const
+{
+    int32_t n = 1 << level_count;
+    double fx = (p.x - origin.x) / boxSize(level_count), fy = (p.y - origin.y) / boxSize(level_count);
+    if (!(fx >= 0 && fy >= 0 && fx <= n && fy <= n))
+    {
+        return false;
+    }
+    i = std::min(static_cast<int32_t>(fx), n - 1);
+    j = std::min(static_cast<int32_t>(fy), n - 1);
+    return true;
+}
+
+void fmm_t::sync(const charges_t& charges, vec2_t lo, vec2_t hi)
+{
+    if (charges.version != version || order != built_order || lo != built_lo || hi != built_hi)
+    {
+        build(charges, lo, hi);
+    }
+}
+
+void fmm_t::build(const charges_t& charges, vec2_t lo, vec2_t hi)
+{
+    auto start = std::chrono::steady_clock::now();
+    order = std::clamp(order, 1, max_order);
+    version = charges.version;
+    built_order = order;
+    built_lo = lo;
+    built_hi = hi;
+
+    for (size_t i = 0; i < charges.size(); i++)
+    {
+        lo = glm::min(lo, charges.pos(i));
+        hi = glm::max(hi, charges.pos(i));
+    }
+    size = 1.01 * std::max(hi.x - lo.x, hi.y - lo.y) + 1.0;
+    origin = 0.5f * (lo + hi) - vec2_t(static_cast<float>(size / 2));
+
+    // Aim for a few dozen charges per leaf
+    double leaves = std::max(1.0, static_cast<double>(charges.size()) / 32.0);
+    level_count = std::clamp(static_cast<int32_t>(std::ceil(std::log(leaves) / std::log(4.0))), 2, max_levels);
+    int32_t n = 1 << level_count;
+
+    // Counting sort of the charges into their leaves
+    std::vector<uint32_t> leaf(charges.size());
+    leaf_start.assign(static_cast<size_t>(n) * n + 1, 0);
+    for (size_t c = 0; c < charges.size(); c++)
+    {
+        int32_t i, j;
+        leafOf(charges.pos(c), i, j);
+        leaf[c] = static_cast<uint32_t>(j * n + i);
+        leaf_start[leaf[c] + 1]++;
+    }
+    for (size_t b = 1; b < leaf_start.size(); b++)
+    {
+        leaf_start[b] += leaf_start[b - 1];
+    }
+    x.resize(charges.size());
+    y.resize(charges.size());
+    strength.resize(charges.size());
+    std::vector<uint32_t> fill(leaf_start.begin(), leaf_start.end() - 1);
+    for (size_t c = 0; c < charges.size(); c++)
+    {
+        uint32_t dst = fill[leaf[c]]++;
+        x[dst] = charges.x[c];
+        y[dst] = charges.y[c];
+        strength[dst] = charges.strength[c];
+    }
+
+    multipole.assign(level_count + 1, {});
+    local.assign(level_count + 1, {});
+    for (int32_t l = 2; l <= level_count; l++)
+    {
+        multipole[l].assign((size_t(1) << (2 * l)) * terms(), 0.0);
+        local[l].assign((size_t(1) << (2 * l)) * terms(), 0.0);
+    }
+    upward();
+    interactions();
+    downward();
+    build_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+void fmm_t::upward()
+{
+    const int32_t p = built_order;
+    const size_t nt = terms();
+    double px[max_order + 1], py[max_order + 1];
+
+    // Charges to leaf multipoles, M_(a,b) = sum q (-dx)^a (-dy)^b about the leaf center
+    int32_t n = 1 << level_count;
+    for (int32_t j = 0; j < n; j++)
+    {
+        for (int32_t i = 0; i < n; i++)
+        {
+            vec2_t c = boxCenter(level_count, i, j);
+            double* m = &multipole[level_count][(size_t(j) * n + i) * nt];
+            for (uint32_t q = leaf_start[j * n + i]; q < leaf_start[j * n + i + 1]; q++)
+            {
+                powers(c.x - static_cast<double>(x[q]), p, px);
+                powers(c.y - static_cast<double>(y[q]), p, py);
+                for (int32_t a = 0; a <= p; a++)
+                {
+                    for (int32_t b = 0; a + b <= p; b++)
+                    {
+                        m[termIndex(a, b)] += strength[q] * px[a] * py[b];
+                    }
+                }
+            }
+        }
+    }
+
+    // Children to parents, shifting each child expansion by s = child center - parent center
+    for (int32_t l = level_count - 1; l >= 2; l--)
+    {
+        int32_t np = 1 << l;
+        double quarter = boxSize(l + 1) / 2;
+        for (int32_t j = 0; j < np; j++)
+        {
+            for (int32_t i = 0; i < np; i++)
+            {
+                double* parent = &multipole[l][(size_t(j) * np + i) * nt];
+                for (int32_t c = 0; c < 4; c++)
+                {
+                    int32_t ci = 2 * i + (c & 1), cj = 2 * j + (c >> 1);
+                    const double* child = &multipole[l + 1][(size_t(cj) * 2 * np + ci) * nt];
+                    powers((c & 1) ? -quarter : quarter, p, px);
+                    powers((c >> 1) ? -quarter : quarter, p, py);
+                    for (int32_t a = 0; a <= p; a++)
+                    {
+                        for (int32_t b = 0; a + b <= p; b++)
+                        {
+                            double sum = 0;
+                            for (int32_t ca = 0; ca <= a; ca++)
+                            {
+                                for (int32_t cb = 0; cb <= b; cb++)
+                                {
+                                    sum += binomial(a, ca) * binomial(b, cb) * child[termIndex(ca, cb)] * px[a - ca] * py[b - cb];
+                                }
+                            }
+                            parent[termIndex(a, b)] += sum;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+void fmm_t::interactions()
+{
+    const int32_t p = built_order;
+    const size_t nt = terms();
+    std::vector<double> t(termCount(2 * p));
+    // Translation matrix for every source offset in the 7x7 neighbourhood of the target
+    std::vector<double> matrices(49 * nt * nt);
+
+    for (int32_t l = 2; l <= level_count; l++)
+    {
+        double h = boxSize(l);
+        for (int32_t oj = -3; oj <= 3; oj++)
+        {
+            for (int32_t oi = -3; oi <= 3; oi++)
+            {
+                if (std::abs(oi) <= 1 && std::abs(oj) <= 1)
+                {
+                    continue;
+                }
+                derivatives(oi * h, oj * h, 2 * p, t.data());
+                double* mat = &matrices[((oj + 3) * 7 + oi + 3) * nt * nt];
+                for (int32_t a = 0; a <= p; a++)
+                {
+                    for (int32_t b = 0; a + b <= p; b++)
+                    {
+                        for (int32_t ma = 0; ma <= p; ma++)
+                        {
+                            for (int32_t mb = 0; ma + mb <= p; mb++)
+                            {
+                                mat[termIndex(a, b) * nt + termIndex(ma, mb)] =
+                                    binomial(a + ma, ma) * binomial(b + mb, mb) * t[termIndex(a + ma, b + mb)];
+                            }
+                        }
+                    }
+                }
+            }
+        }
+
+        // Interaction list: children of the parent's neighbours that are not adjacent to the box
+        int32_t n = 1 << l;
+        for (int32_t j = 0; j < n; j++)
+        {
+            for (int32_t i = 0; i < n; i++)
+            {
+                double* target = &local[l][(size_t(j) * n + i) * nt];
+                for (int32_t sj = std::max(0, (j / 2 - 1) * 2); sj < std::min(n, (j / 2 + 2) * 2); sj++)
+                {
+                    for (int32_t si = std::max(0, (i / 2 - 1) * 2); si < std::min(n, (i / 2 + 2) * 2); si++)
+                    {
+                        int32_t oi = i - si, oj = j - sj;
+                        if (std::abs(oi) <= 1 && std::abs(oj) <= 1)
+                        {
+                            continue;
+                        }
+                        const double* source = &multipole[l][(size_t(sj) * n + si) * nt];
+                        const double* mat = &matrices[((oj + 3) * 7 + oi + 3) * nt * nt];
+                        for (size_t row = 0; row < nt; row++)
+                        {
+                            double sum = 0;
+                            for (size_t col = 0; col < nt; col++)
+                            {
+                                sum += mat[row * nt + col] * source[col];
+                            }
+                            target[row] += sum;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+void fmm_t::downward()
+{
+    const int32_t p = built_order;
+    const size_t nt = terms();
+    double px[max_order + 1], py[max_order + 1];
+
+    // Parents to children, re-centring each local expansion on s = child center - parent center
+    for (int32_t l = 2; l < level_count; l++)
+    {
+        int32_t np = 1 << l;
+        double quarter = boxSize(l + 1) / 2;
+        for (int32_t j = 0; j < np; j++)
+        {
+            for (int32_t i = 0; i < np; i++)
+            {
+                const double* parent = &local[l][(size_t(j) * np + i) * nt];
+                for (int32_t c = 0; c < 4; c++)
+                {
+                    int32_t ci = 2 * i + (c & 1), cj = 2 * j + (c >> 1);
+                    double* child = &local[l + 1][(size_t(cj) * 2 * np + ci) * nt];
+                    powers((c & 1) ? quarter : -quarter, p, px);
+                    powers((c >> 1) ? quarter : -quarter, p, py);
+                    for (int32_t a = 0; a <= p; a++)
+                    {
+                        for (int32_t b = 0; a + b <= p; b++)
+                        {
+                            double sum = 0;
+                            for (int32_t ma = a; ma <= p; ma++)
+                            {
+                                for (int32_t mb = b; ma + mb <= p; mb++)
+                                {
+                                    sum += binomial(ma, a) * binomial(mb, b) * parent[termIndex(ma, mb)] * px[ma - a] * py[mb - b];
+                                }
+                            }
+                            child[termIndex(a, b)] += sum;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+bool fmm_t::nearField(int32_t i, int32_t j, vec2_t p, double out[3]) const
+{
+    int32_t n = 1 << level_count;
+    for (int32_t sj = std::max(0, j - 1); sj <= std::min(n - 1, j + 1); sj++)
+    {
+        // The three leaves of a row are contiguous in the sorted arrays
+        uint32_t begin = leaf_start[sj * n + std::max(0, i - 1)], end = leaf_start[sj * n + std::min(n - 1, i + 1) + 1];
+        for (uint32_t q = begin; q < end; q++)
+        {
+            double dx = p.x - x[q], dy = p.y - y[q];
+            double r2 = dx * dx + dy * dy;
+            if (r2 == 0)
+            {
+                return false;
+            }
+            double inv = 1.0 / std::sqrt(r2);
+            double s = strength[q] * inv * inv * inv;
+            out[0] += s * dx;
+            out[1] += s * dy;
+            out[2] += strength[q] * inv;
+        }
+    }
+    return true;
+}
+
+void fmm_t::farField(vec2_t p, double out[3]) const
+{
+    const int32_t pord = built_order;
+    const size_t nt = terms();
+    double t[termCount(max_order + 1)];
+    struct box_t
+    {
+        int32_t level, i, j;
+    };
+    std::vector<box_t> stack;
+    for (int32_t j = 0; j < 4; j++)
+    {
+        for (int32_t i = 0; i < 4; i++)
+        {
+            stack.push_back({2, i, j});
+        }
+    }
+    while (!stack.empty())
+    {
+        box_t box = stack.back();
+        stack.pop_back();
+        vec2_t c = boxCenter(box.level, box.i, box.j);
+        double dx = p.x - c.x, dy = p.y - c.y;
+        double h = boxSize(box.level);
+        if (h * h < 0.25 * (dx * dx + dy * dy))
+        {
+            // phi = sum M_m T_m(p - c), d/dx T_m = (m_x + 1) T_(m + e_x)
+            const double* m = &multipole[box.level][(size_t(box.j) * (1 << box.level) + box.i) * nt];
+            derivatives(dx, dy, pord + 1, t);
+            for (int32_t a = 0; a <= pord; a++)
+            {
+                for (int32_t b = 0; a + b <= pord; b++)
+                {
+                    double mm = m[termIndex(a, b)];
+                    out[0] -= mm * (a + 1) * t[termIndex(a + 1, b)];
+                    out[1] -= mm * (b + 1) * t[termIndex(a, b + 1)];
+                    out[2] += mm * t[termIndex(a, b)];
+                }
+            }
+        }
+        else if (box.level < level_count)
+        {
+            for (int32_t ch = 0; ch < 4; ch++)
+            {
+                stack.push_back({box.level + 1, 2 * box.i + (ch & 1), 2 * box.j + (ch >> 1)});
+            }
+        }
+        else
+        {
+            int32_t b = box.j * (1 << level_count) + box.i;
+            for (uint32_t q = leaf_start[b]; q < leaf_start[b + 1]; q++)
+            {
+                double qx = p.x - x[q], qy = p.y - y[q];
+                double inv = 1.0 / std::sqrt(qx * qx + qy * qy);
+                out[0] += strength[q] * qx * inv * inv * inv;
+                out[1] += strength[q] * qy * inv * inv * inv;
+                out[2] += strength[q] * inv;
+            }
+        }
+    }
+}
+
+void fmm_t::evaluate(vec2_t p, double out[3]) const
+{
+    out[0] = out[1] = out[2] = 0;
+    if (level_count == 0)
+    {
+        return;
+    }
+    int32_t i, j;
+    if (!leafOf(p, i, j))
+    {
+        farField(p, out);
+        return;
+    }
+    if (!nearField(i, j, p, out))
+    {
+        out[0] = out[1] = out[2] = 0;
+        return;
+    }
+    // Local expansion of everything outside the neighbourhood, E = -grad phi
+    const int32_t pord = built_order;
+    vec2_t c = boxCenter(level_count, i, j);
+    double px[max_order + 1], py[max_order + 1];
+    powers(p.x - static_cast<double>(c.x), pord, px);
+    powers(p.y - static_cast<double>(c.y), pord, py);
+    const double* l = &local[level_count][(size_t(j) * (1 << level_count) + i) * terms()];
+    for (int32_t a = 0; a <= pord; a++)
+    {
+        for (int32_t b = 0; a + b <= pord; b++)
+        {
+            double coefficient = l[termIndex(a, b)];
+            out[2] += coefficient * px[a] * py[b];
+            if (a > 0)
+            {
+                out[0] -= coefficient * a * px[a - 1] * py[b];
+            }
+            if (b > 0)
+            {
+                out[1] -= coefficient * b * px[a] * py[b - 1];
+            }
+        }
+    }
+}
+
+vec2_t fmm_t::forceAt(vec2_t p) const
+{
+    double out[3];
+    evaluate(p, out);
+    return k * vec2_t(out[0], out[1]);
+}
+
+float fmm_t::potentialAt(vec2_t p) const
+{
+    double out[3];
+    evaluate(p, out);
+    return static_cast<float>(k * out[2]);
+}
+
+fmm_t::error_t fmm_t::measureError(const charges_t& charges, size_t samples) const
+{
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<float> ux(origin.x, origin.x + size), uy(origin.y, origin.y + size);
+    std::vector<vec2_t> points(samples), reference(samples);
+    for (vec2_t& point : points)
+    {
+        point = vec2_t(ux(rng), uy(rng));
+    }
+    ::forceAt(charges, points, reference);
+
+    error_t error;
+    double err2 = 0, ref2 = 0;
+    for (size_t s = 0; s < samples; s++)
+    {
+        vec2_t diff = forceAt(points[s]) - reference[s];
+        double e = glm::length(diff), r = glm::length(reference[s]);
+        err2 += e * e;
+        ref2 += r * r;
+        if (r > 0)
+        {
+            error.max = std::max(error.max, e / r);
+            error.samples++;
+        }
+    }
+    error.rms = ref2 > 0 ? std::sqrt(err2 / ref2) : 0;
+    return error;
+}
@@ -0,0 +1,66 @@
+#pragma once
+#include "field.h"
+#include <cstdint>
+#include <vector>
+
+// Fast multipole method over a uniform quadtree.
+// The charges are 3D point charges (potential q / r) restricted to the plane, which is not a harmonic
+// kernel in 2D, so expansions are cartesian Taylor series of 1 / r rather than complex power series.
+class fmm_t
+{
+public:
+    static constexpr int32_t max_order = 16;
+    static constexpr int32_t max_levels = 7;
+
+    int32_t order = 8;
+
+    // Rebuilds if the charges, the order or the covered region changed since the last build.
+    // The tree covers the charges plus [lo, hi], points outside it fall back to a multipole tree walk.
+    void sync(const charges_t& charges, vec2_t lo, vec2_t hi);
+    void build(const charges_t& charges, vec2_t lo, vec2_t hi);
+
+    vec2_t forceAt(vec2_t p) const;
+    float potentialAt(vec2_t p) const;
+
+    struct error_t
+    {
+        double rms = 0;
+        double max = 0;
+        size_t samples = 0;
+    };
+    // Relative error of forceAt against the direct sum on random points inside the tree
+    error_t measureError(const charges_t& charges, size_t samples) const;
+
+    int32_t levels() const { return level_count; }
+    double buildMilliseconds() const { return build_ms; }
+
+private:
+    int32_t level_count = 0;
+    int32_t built_order = -1;
+    uint64_t version = ~uint64_t(0);
+    vec2_t built_lo, built_hi;
+    double build_ms = 0;
+
+    vec2_t origin; // lower left corner of the root box
+    double size = 0; // side of the root box
+
+    // Charges sorted by leaf, leaf_start[b] .. leaf_start[b + 1] belong to leaf b
+    std::vector<float> x, y, strength;
+    std::vector<uint32_t> leaf_start;
+
+    // Expansion coefficients per level, box (i, j) at level l starts at ((j << l) + i) * terms
+    std::vector<std::vector<double>> multipole, local;
+
+    size_t terms() const;
+    double boxSize(int32_t level) const { return size / (1 << level); }
+    vec2_t boxCenter(int32_t level, int32_t i, int32_t j) const;
+    bool leafOf(vec2_t p, int32_t& i, int32_t& j) const;
+
+    void upward();
+    void interactions();
+    void downward();
+    // Accumulates the negative gradient (out[0], out[1]) and the potential (out[2]) at p
+    void evaluate(vec2_t p, double out[3]) const;
+    bool nearField(int32_t i, int32_t j, vec2_t p, double out[3]) const;
+    void farField(vec2_t p, double out[3]) const;
+};
@@ -0,0 +1,379 @@
+#include "export.h"
+#include "qoi.h"
+#include "scene.h"
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+// Renders scenes straight to image files without opening a window. Options accumulate from left to right
+// and every -o renders the state so far, a --batch file holds one such argument list per line. Images are
+// drawn in tiles and streamed to the file, so they can be far larger than memory. Outputs ending in .svg or
+// .pdf get the lines as vector paths instead. --convert turns QOI frame dumps from the viewer into PNGs.
+
+namespace
+{
+    struct job_t
+    {
+        charges_t charges;
+        render_settings_t settings;
+        std::string output;
+        // Write the scene itself to `output` instead of rendering it
+        bool scene_output = false;
+        // Convert this QOI image to a PNG at `output` instead of rendering
+        std::string convert;
+        // Center the view on the world origin, until --origin or --scene place it
+        bool centered = true;
+        int png_level = 6;
+    };
+
+    void usage()
+    {
+        std::cerr << "usage: headless [options] -o out.png|out.svg|out.pdf\n"
+                     "  --charge x,y,q          add a charge\n"
+                     "  --charges file          add the charges of a text file, one \"x y q\" per line\n"
+                     "  --scene file            replace the charges and settings with those of a scene file\n"
+                     "  --save-scene file       write the charges and settings so far as a scene file\n"
+                     "  --size WxH              image size in pixels\n"
+                     "  --zoom z                pixels per world unit, 1 by default\n"
+                     "  --origin x,y            world position of the lower left pixel, centered by default\n"
+                     "  --[no-]fieldlines --[no-]arrows --[no-]clip --[no-]equipotential --[no-]heatmap\n"
+                     "  --lines n --tmax n --line-dist d\n"
+                     "  --integrator euler|rk4|rk45 --step h --tolerance t\n"
+                     "  --rings n --ring-dist n --equi-spacing s\n"
+                     "  --quantity magnitude|potential --scale linear|log --colormap viridis|inferno|grayscale|coolwarm\n"
+                     "  --method direct|barnes-hut|fmm --theta t --order p\n"
+                     "  --grid spacing --interpolation bilinear|bicubic   kept in saved scenes, images are drawn without the grid\n"
+                     "  --png-level n           zlib level of PNG output, 0 (fastest) to 9 (smallest), 6 by default\n"
+                     "  --batch file            one argument list per line, each ending with its own -o\n"
+                     "  --convert in.qoi        write in.png with the pixels of a QOI image\n";
+    }
+
+    // Index of `value` in `names`, -1 if it is not one of them
+    template <size_t N>
+    int lookup(std::string_view value, const char* const (&names)[N])
+    {
+        for (size_t i = 0; i < N; i++)
+        {
+            if (value == names[i])
+            {
+                return static_cast<int>(i);
+            }
+        }
+        return -1;
+    }
+
+    const char* const integrator_keys[] = {"euler", "rk4", "rk45"};
+    const char* const quantity_keys[] = {"magnitude", "potential"};
+    const char* const scale_keys[] = {"linear", "log"};
+    const char* const colormap_keys[] = {"viridis", "inferno", "grayscale", "coolwarm"};
+    const char* const method_keys[] = {"direct", "barnes-hut", "fmm"};
+    const char* const interpolation_keys[] = {"bilinear", "bicubic"};
+
+    bool loadCharges(const std::string& path, charges_t& charges)
+    {
+        std::ifstream in(path);
+        if (!in)
+        {
+            return false;
+        }
+        std::string line;
+        while (std::getline(in, line))
+        {
+            charge_t c;
+            if (std::sscanf(line.c_str(), "%f %f %f", &c.pos.x, &c.pos.y, &c.strength) == 3)
+            {
+                charges.add(c);
+            }
+        }
+        return true;
+    }
+
+    // Applies the arguments to `job`, handing every finished job (one per -o) to `emit`
+    template <typename emit_t>
+    bool parse(const std::vector<std::string>& args, job_t& job, emit_t&& emit)
+    {
+        for (size_t i = 0; i < args.size(); i++)
+        {
+            std::string_view arg = args[i];
+            auto value = [&]() -> const char* { return i + 1 < args.size() ? args[++i].c_str() : nullptr; };
+            // Parses the next argument into an enum through its keyword table
+            auto choice = [&](auto& target, const auto& keys)
+            {
+                const char* v = value();
+                int index = v ? lookup(v, keys) : -1;
+                if (index < 0)
+                {
+                    return false;
+                }
+                target = static_cast<std::remove_reference_t<decltype(target)>>(index);
+                return true;
+            };
+            // The whole value has to parse, so 2.5 for an integer option is an error instead of 2
+            auto number = [&](auto& target, const char* format)
+            {
+                const char* v = value();
+                int used = 0;
+                return v && std::sscanf(v, (std::string(format) + "%n").c_str(), &target, &used) == 1 && v[used] == '\0';
+            };
+            // Sizes and steps, zero or infinity would divide the view into no cells or endless ones
+            auto positive = [&](float& target) { return number(target, "%f") && target > 0 && std::isfinite(target); };
+
+            render_settings_t& s = job.settings;
+            bool ok = true;
+            if (arg == "-o" || arg == "--output")
+            {
+                const char* v = value();
+                if (!v)
+                {
+                    std::cerr << "Error: -o expects a file name\n";
+                    return false;
+                }
+                job.output = v;
+                emit(job);
+            }
+            else if (arg == "--charge")
+            {
+                charge_t c;
+                const char* v = value();
+                ok = v && std::sscanf(v, "%f,%f,%f", &c.pos.x, &c.pos.y, &c.strength) == 3;
+                if (ok)
+                {
+                    job.charges.add(c);
+                }
+            }
+            else if (arg == "--charges")
+            {
+                const char* v = value();
+                ok = v && loadCharges(v, job.charges);
+            }
+            else if (arg == "--scene")
+            {
+                const char* v = value();
+                scene_t scene;
+                std::string error;
+                ok = v && loadScene(v, scene, error);
+                if (ok)
+                {
+                    job.charges = std::move(scene.charges);
+                    job.settings = scene.settings;
+                    job.centered = false;
+                }
+                else if (v)
+                {
+                    std::cerr << "Error: " << error << "\n";
+                }
+            }
+            else if (arg == "--save-scene")
+            {
+                const char* v = value();
+                ok = v != nullptr;
+                if (ok)
+                {
+                    job.output = v;
+                    job.scene_output = true;
+                    emit(job);
+                    job.scene_output = false;
+                }
+            }
+            else if (arg == "--convert")
+            {
+                const char* v = value();
+                ok = v != nullptr;
+                if (ok)
+                {
+                    job.convert = v;
+                    std::string_view stem = job.convert;
+                    if (stem.ends_with(".qoi"))
+                    {
+                        stem.remove_suffix(4);
+                    }
+                    job.output = std::string(stem) + ".png";
+                    emit(job);
+                    job.convert.clear();
+                }
+            }
+            else if (arg == "--size")
+            {
+                const char* v = value();
+                ok = v && std::sscanf(v, "%dx%d", &s.width, &s.height) == 2 && s.width > 0 && s.height > 0;
+            }
+            else if (arg == "--zoom")
+                ok = positive(s.zoom);
+            else if (arg == "--origin")
+            {
+                const char* v = value();
+                ok = v && std::sscanf(v, "%f,%f", &s.origin.x, &s.origin.y) == 2;
+                job.centered = false;
+            }
+            else if (arg == "--fieldlines" || arg == "--no-fieldlines")
+                s.fieldlines = arg == "--fieldlines";
+            else if (arg == "--arrows" || arg == "--no-arrows")
+                s.arrows = arg == "--arrows";
+            else if (arg == "--clip" || arg == "--no-clip")
+                s.symmetry = arg == "--clip";
+            else if (arg == "--equipotential" || arg == "--no-equipotential")
+                s.equipotential = arg == "--equipotential";
+            else if (arg == "--heatmap" || arg == "--no-heatmap")
+                s.fieldcolor = arg == "--heatmap";
+            else if (arg == "--lines")
+                ok = number(s.num_lines, "%d");
+            else if (arg == "--tmax")
+                ok = number(s.tmax, "%d");
+            else if (arg == "--line-dist")
+                ok = positive(s.line_dist);
+            else if (arg == "--integrator")
+                ok = choice(s.trace.integrator, integrator_keys);
+            else if (arg == "--step")
+                ok = positive(s.trace.step);
+            else if (arg == "--tolerance")
+                ok = positive(s.trace.tolerance);
+            else if (arg == "--rings")
+                ok = number(s.ring_count, "%d");
+            else if (arg == "--ring-dist")
+                ok = number(s.equipotential_dist, "%d");
+            else if (arg == "--equi-spacing")
+                ok = positive(s.equipotential_spacing);
+            else if (arg == "--quantity")
+                ok = choice(s.heat_quantity, quantity_keys);
+            else if (arg == "--scale")
+                ok = choice(s.heat_scale, scale_keys);
+            else if (arg == "--colormap")
+                ok = choice(s.colormap, colormap_keys);
+            else if (arg == "--method")
+                ok = choice(s.method, method_keys);
+            else if (arg == "--theta")
+                ok = number(s.theta, "%f");
+            else if (arg == "--order")
+                ok = number(s.fmm_order, "%d") && s.fmm_order >= 1 && s.fmm_order <= fmm_t::max_order;
+            else if (arg == "--grid")
+            {
+                ok = positive(s.grid_spacing);
+                s.use_grid = true;
+            }
+            else if (arg == "--interpolation")
+                ok = choice(s.interpolation, interpolation_keys);
+            else if (arg == "--png-level")
+                ok = number(job.png_level, "%d") && job.png_level >= 0 && job.png_level <= 9;
+            else if (arg == "--batch")
+            {
+                const char* v = value();
+                std::ifstream in(v ? v : "");
+                if (!in)
+                {
+                    std::cerr << "Error: cannot read batch file " << (v ? v : "") << "\n";
+                    return false;
+                }
+                std::string line;
+                while (std::getline(in, line))
+                {
+                    std::istringstream words(line);
+                    std::vector<std::string> batch_args{std::istream_iterator<std::string>(words), std::istream_iterator<std::string>()};
+                    if (batch_args.empty() || batch_args[0].starts_with("#"))
+                    {
+                        continue;
+                    }
+                    // Every line starts over from the command line state
+                    job_t line_job = job;
+                    if (!parse(batch_args, line_job, emit))
+                    {
+                        return false;
+                    }
+                }
+            }
+            else
+            {
+                std::cerr << "Error: unknown option " << arg << "\n";
+                return false;
+            }
+            if (!ok)
+            {
+                std::cerr << "Error: bad value for " << arg << "\n";
+                return false;
+            }
+        }
+        return true;
+    }
+} // namespace
+
+int main(int argc, char** argv)
+{
+    std::vector<std::string> args(argv + 1, argv + argc);
+    if (args.empty() || args[0] == "-h" || args[0] == "--help")
+    {
+        usage();
+        return args.empty() ? 1 : 0;
+    }
+
+    size_t written = 0, failed = 0;
+    // Shared by every job, its Barnes-Hut tree and FMM expansions are only rebuilt when the charges (by
+    // their version) or the view change, so batch lines that differ in drawing settings skip that work
+    solver_t solver;
+    auto emit = [&](const job_t& job)
+    {
+        render_settings_t settings = job.settings;
+        if (job.centered)
+        {
+            settings.origin = -vec2_t((settings.width - 1) / 2, (settings.height - 1) / 2) / settings.zoom;
+        }
+        if (job.scene_output)
+        {
+            std::string error;
+            if (!saveScene(job.output, job.charges, settings, error))
+            {
+                std::cerr << "Error: " << error << "\n";
+                failed++;
+                return;
+            }
+            written++;
+            std::cout << job.output << "\n";
+            return;
+        }
+        auto start = std::chrono::steady_clock::now();
+        std::string error;
+        if (!job.convert.empty())
+        {
+            std::vector<color_t> pixels;
+            int32_t width, height;
+            if (!loadQOI(job.convert, pixels, width, height, error) || !savePNG(pixels, width, height, job.output, error, job.png_level))
+            {
+                std::cerr << "Error: " << error << "\n";
+                failed++;
+                return;
+            }
+            written++;
+            std::cout << job.output << "\n";
+            return;
+        }
+        bool vector = job.output.ends_with(".svg") || job.output.ends_with(".pdf");
+        if (!(vector ? exportVector(job.charges, settings, job.output, error, &solver)
+                     : exportPNG(job.charges, settings, job.output, error, 256, job.png_level, nullptr, &solver)))
+        {
+            std::cerr << "Error: " << error << "\n";
+            failed++;
+            return;
+        }
+        written++;
+        std::cout << job.output << " " << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() << " ms\n";
+    };
+
+    job_t job;
+    if (!parse(args, job, emit))
+    {
+        usage();
+        return 1;
+    }
+    if (written == 0 && failed == 0)
+    {
+        std::cerr << "Error: nothing to do, no -o, --save-scene or --convert given\n";
+        return 1;
+    }
+    return failed ? 1 : 0;
+}
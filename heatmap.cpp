@@ -0,0 +1,168 @@
+#include "heatmap.h"
+#include "parallel.h"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <limits>
+
+namespace
+{
+    using lut_t = std::array<color_t, 256>;
+
+    color_t toColor(float r, float g, float b)
+    {
+        auto channel = [](float v) { return static_cast<uint8_t>(std::clamp(v, 0.0f, 1.0f) * 255.0f + 0.5f); };
+        return color_t(channel(r), channel(g), channel(b), 0);
+    }
+
+    // Sixth degree polynomial fits of the matplotlib colormaps
+    lut_t polynomialLut(const std::array<std::array<float, 3>, 7>& c)
+    {
+        lut_t lut;
+        for (size_t i = 0; i < lut.size(); i++)
+        {
+            float t = i / 255.0f;
+            float rgb[3];
+            for (size_t ch = 0; ch < 3; ch++)
+            {
+                float v = c[6][ch];
+                for (size_t d = 6; d-- > 0;)
+                {
+                    v = v * t + c[d][ch];
+                }
+                rgb[ch] = v;
+            }
+            lut[i] = toColor(rgb[0], rgb[1], rgb[2]);
+        }
+        return lut;
+    }
+
+    const std::array<lut_t, 4>& luts()
+    {
+        static const std::array<lut_t, 4> tables = []
+        {
+            std::array<lut_t, 4> t;
+            t[static_cast<size_t>(colormap_t::viridis)] = polynomialLut({{{0.2777273272234177f, 0.005407344544966578f, 0.3340998053353061f},
+                                                                          {0.1050930431085774f, 1.404613529898575f, 1.384590162594685f},
+                                                                          {-0.3308618287255563f, 0.214847559468213f, 0.09509516302823659f},
+                                                                          {-4.634230498983486f, -5.799100973351585f, -19.33244095627987f},
+                                                                          {6.228269936347081f, 14.17993336680509f, 56.69055260068105f},
+                                                                          {4.776384997670288f, -13.74514537774601f, -65.35303263337234f},
+                                                                          {-5.435455855934631f, 4.645852612178535f, 26.3124352495832f}}});
+            t[static_cast<size_t>(colormap_t::inferno)] = polynomialLut({{{0.0002189403691192265f, 0.001651004631001012f, -0.01948089843709184f},
+                                                                          {0.1065134194856116f, 0.5639564367884091f, 3.932712388889277f},
+                                                                          {11.60249308247187f, -3.972853965665698f, -15.9423941062914f},
+                                                                          {-41.70399613139459f, 17.43639888205313f, 44.35414519872813f},
+                                                                          {77.162935699427f, -33.40235894210092f, -81.80730925738993f},
+                                                                          {-71.31942824499214f, 32.62606426397723f, 73.20951985803202f},
+                                                                          {25.13112622477341f, -12.24266895238567f, -23.07032500287172f}}});
+            for (size_t i = 0; i < 256; i++)
+            {
+                float v = i / 255.0f;
+                t[static_cast<size_t>(colormap_t::grayscale)][i] = toColor(v, v, v);
+                // Blue through white to red, for signed quantities
+                float a = std::abs(2 * v - 1);
+                t[static_cast<size_t>(colormap_t::coolwarm)][i] = v < 0.5f ? toColor(1 - 0.8f * a, 1 - 0.7f * a, 1) : toColor(1, 1 - 0.7f * a, 1 - 0.8f * a);
+            }
+            return t;
+        }();
+        return tables;
+    }
+
+    // Value at fraction q of the sorted sample
+    float percentile(std::vector<float>& sample, float q)
+    {
+        auto nth = sample.begin() + static_cast<ptrdiff_t>(q * (sample.size() - 1));
+        std::nth_element(sample.begin(), nth, sample.end());
+        return *nth;
+    }
+} // namespace
+
+void heatmap_t::render(const solver_t& solver, std::span<color_t> pixels, int32_t width, int32_t height, vec2_t origin, float step, const range_t* fixed,
+                       glm::ivec2 first)
+{
+    values.resize(static_cast<size_t>(width) * height);
+    bool magnitude = quantity == heat_quantity_t::magnitude;
+    parallelFor(height,
+                [&](size_t begin, size_t end)
+                {
+                    std::vector<vec2_t> points(width), forces(width);
+                    for (size_t y = begin; y < end; y++)
+                    {
+                        for (int32_t x = 0; x < width; x++)
+                        {
+                            points[x] = origin + step * vec2_t(first.x + x + 0.5f, first.y + y + 0.5f);
+                        }
+                        std::span<float> row = std::span(values).subspan(y * width, width);
+                        if (magnitude)
+                        {
+                            solver.forceAt(points, forces);
+                            for (int32_t x = 0; x < width; x++)
+                            {
+                                row[x] = glm::length(forces[x]);
+                            }
+                        }
+                        else
+                        {
+                            solver.potentialAt(points, row);
+                        }
+                    }
+                });
+    if (values.empty())
+    {
+        return;
+    }
+
+    bool log = scale == heat_scale_t::log;
+    // Signed log keeps the sign of the potential, asinh(v / reference) ~ log for |v| >> reference
+    auto transform = [log, magnitude](float v, float reference)
+    { return log ? (magnitude ? std::log10(v + reference * 1e-3f) : std::asinh(v / reference)) : v; };
+    if (fixed)
+    {
+        range = *fixed;
+    }
+    else
+    {
+        // Range from a strided sample so the singular pixels next to charges don't wash the map out
+        std::vector<float> sample;
+        size_t stride = std::max<size_t>(1, values.size() / 4096);
+        for (size_t i = 0; i < values.size(); i += stride)
+        {
+            sample.push_back(std::abs(values[i]));
+        }
+        range.reference = std::max(percentile(sample, 0.5f), std::numeric_limits<float>::min());
+        sample.clear();
+        for (size_t i = 0; i < values.size(); i += stride)
+        {
+            sample.push_back(transform(values[i], range.reference));
+        }
+        if (magnitude)
+        {
+            range.lo = percentile(sample, 0.01f);
+            range.hi = percentile(sample, 0.99f);
+        }
+        else
+        {
+            for (float& v : sample)
+            {
+                v = std::abs(v);
+            }
+            range.hi = percentile(sample, 0.99f);
+            range.lo = -range.hi;
+        }
+    }
+    float reference = range.reference, lo = range.lo, hi = range.hi;
+    float inv = hi > lo ? 255.0f / (hi - lo) : 0.0f;
+    const lut_t& lut = luts()[static_cast<size_t>(colormap)];
+    parallelFor(
+        values.size(),
+        [&](size_t begin, size_t end)
+        {
+            for (size_t i = begin; i < end; i++)
+            {
+                float t = std::clamp((transform(values[i], reference) - lo) * inv, 0.0f, 255.0f);
+                pixels[i] = lut[static_cast<size_t>(t + 0.5f)];
+            }
+        },
+        4096);
+}
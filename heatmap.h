@@ -0,0 +1,55 @@
+#pragma once
+#include "color.h"
+#include "solver.h"
+#include <cstdint>
+#include <span>
+#include <vector>
+
+enum class heat_quantity_t
+{
+    magnitude,
+    potential,
+};
+
+enum class heat_scale_t
+{
+    linear,
+    log,
+};
+
+enum class colormap_t
+{
+    viridis,
+    inferno,
+    grayscale,
+    coolwarm,
+};
+
+inline const char* heat_quantity_names[] = {"|E|", "Potential"};
+inline const char* heat_scale_names[] = {"Linear", "Log"};
+inline const char* colormap_names[] = {"Viridis", "Inferno", "Grayscale", "Coolwarm"};
+
+// Field magnitude or potential over every pixel, mapped through a colormap
+struct heatmap_t
+{
+    heat_quantity_t quantity = heat_quantity_t::magnitude;
+    heat_scale_t scale = heat_scale_t::log;
+    colormap_t colormap = colormap_t::viridis;
+
+    // How values map onto the colormap, reference is where the log scale turns linear
+    struct range_t
+    {
+        float reference = 1, lo = 0, hi = 0;
+    };
+
+    // Pixel (x, y) is sampled at its center, origin + step * (first + (x, y) + 0.5). The range is fitted to the
+    // pixels unless `fixed` is given, tiles of one image pass the range fitted to a preview of the whole and
+    // the index of their first pixel in it.
+    void render(const solver_t& solver, std::span<color_t> pixels, int32_t width, int32_t height, vec2_t origin, float step,
+                const range_t* fixed = nullptr, glm::ivec2 first = glm::ivec2(0));
+    const range_t& lastRange() const { return range; }
+
+private:
+    std::vector<float> values;
+    range_t range;
+};
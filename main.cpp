@@ -1,228 +1,179 @@
 #define SDL_MAIN_HANDLED
+#include "export_queue.h"
+#include "field.h"
 #include "imgui.h"
 #include "imgui_impl_sdl2.h"
 #include "imgui_impl_sdlrenderer2.h"
+#include "render_thread.h"
+#include "scene.h"
 #include <SDL.h>
-#include <SDL_image.h>
 #include <algorithm>
+#include <array>
+#include <cfloat>
 #include <glm/glm.hpp>
 #include <glm/gtc/type_ptr.hpp>
 #include <iostream>
 #include <limits>
+#include <memory>
 #include <numbers>
+#include <optional>
 #include <ranges>
 #include <span>
+#include <string>
+#include <string_view>
 #include <vector>
 
-using vec2_t = glm::vec<2, float>;
-using color_t = glm::vec<4, uint8_t>;
+// Screen pixels per frame pixel, the frame follows the window size divided by this
+int32_t pixel_scale = 4;
 
-int32_t num_lines = 16;
-const constexpr float line_dist = 2;
-
-const constexpr float FLOAT_EPSILON = 0.05;
-
-const constexpr int32_t PIXEL_SCALE = 4;
-const constexpr int32_t radius = 150;
-const constexpr int32_t xmin = -150, xmax = 150, ymin = -150, ymax = 150, deltax = 2 * 150 + 1, deltay = 2 * 150 + 1;
-
-// const constexpr int32_t PIXEL_SCALE = 1;
-// const constexpr int32_t width = 1920;
-// const constexpr int32_t height = 1080;
-// const constexpr int64_t xmin = -(width / 2), xmax = width / 2, ymin =
-// -(height / 2), ymax = height / 2, deltax = width, deltay = height;
-
-constexpr float e0 = 8.8541878128E-12;
-constexpr float k = 1 / (4 * std::numbers::pi * e0);
-
-int32_t arrow_distance = 50;
-int32_t head_length = 5;
-int32_t head_thickness = 3;
-int32_t tmax = 200;
-float equi_scale = 0.5f;
-int32_t equipotential_t = 200;
-int32_t equipotential_dist = 20;
-int32_t ring_count = 2;
 glm::vec<2, int32_t> cursor_pos;
 
-bool equipotential = true, fieldlines = true, fieldcolor = false, arrows = true, symmetry = true;
-
-namespace colors
+std::ostream& operator<<(std::ostream& outs, vec2_t v)
 {
-    constexpr color_t red(255, 0, 0, 0), green(0, 255, 0, 0), blue(0, 0, 255, 0), white(255, 255, 255, 0), black(0, 0, 0, 0), yellow(255, 255, 0, 0);
+    outs << v.x << " " << v.y;
+    return outs;
 }
 
-color_t line_color = colors::black;
+// charges_t charges = {{{0, 0}, 60}};
+charges_t charges = {{{-60, 0}, -60}, {{60, 0}, -60}};
+// charges_t charges = {{{-60, 0}, -20}, {{60, 0}, -20}, {{0,60}, 20}};
+// charges_t charges = {{{-60, 0}, -20}, {{60, 0}, -20}, {{0, 60}, 20}, {{0, -60}, 20}};
 
-struct charge_t
-{
-    vec2_t pos;
-    float strength;
-};
+render_settings_t settings;
 
-std::ostream& operator<<(std::ostream& outs, vec2_t v)
+// Changes the frame size and zoom, keeping the view centered on the same point
+void setView(int32_t width, int32_t height, float zoom)
 {
-    outs << v.x << " " << v.y;
-    return outs;
+    if (width == settings.width && height == settings.height && zoom == settings.zoom)
+    {
+        return;
+    }
+    vec2_t center = settings.origin + 0.5f * vec2_t(settings.width - 1, settings.height - 1) / settings.zoom;
+    vec2_t origin = center * zoom - 0.5f * vec2_t(width - 1, height - 1);
+    settings.width = width;
+    settings.height = height;
+    settings.zoom = zoom;
+    // Whole pixels so charges on integer positions stay centered on a pixel
+    settings.origin = vec2_t(std::round(origin.x), std::round(origin.y)) / zoom;
 }
 
-// std::array<charge_t, 1> charges = {{{{0, 0}, 60}}};
-std::array<charge_t, 2> charges = {{{{-60, 0}, -60}, {{60, 0}, -60}}};
-// std::array<charge_t, 3> charges = {{{{-60, 0}, -20}, {{60, 0}, -20}, {{0,60}, 20}}};
-// std::array<charge_t, 4> charges = {{{{-60, 0}, -20}, {{60, 0}, -20}, {{0, 60}, 20}, {{0, -60}, 20}}};
+// Sizes the frame to the window at pixel_scale
+void fitToWindow(SDL_Window* window)
+{
+    int w, h;
+    SDL_GetWindowSize(window, &w, &h);
+    setView(std::max(1, w / pixel_scale), std::max(1, h / pixel_scale), settings.zoom);
+}
 
-vec2_t forceAt(vec2_t p)
+// Draws the lines of a frame rendered with vector_lines over its texture, anti-aliased at window resolution
+void drawLineLayer(ImDrawList* list, const frame_t& frame)
 {
-    vec2_t sum(0);
-    for (charge_t c : charges)
+    const render_settings_t& view = frame.settings;
+    auto screen = [&](vec2_t p)
     {
-        if (p == c.pos)
+        vec2_t q = (p - view.origin) * (view.zoom * pixel_scale);
+        return ImVec2(q.x, q.y);
+    };
+    auto imColor = [](color_t c) { return IM_COL32(c.x, c.y, c.z, 255); };
+    float thickness = std::max(1.0f, 0.5f * pixel_scale);
+    std::vector<ImVec2> points;
+    auto polyline = [&](const polyline_t& line, ImU32 color)
+    {
+        // In pieces, the vertices of one primitive have to fit 16-bit indices
+        constexpr size_t piece = 4096;
+        for (size_t begin = 0; begin + 1 < line.size(); begin += piece - 1)
         {
-            return vec2_t(0.0f);
+            points.clear();
+            for (size_t i = begin; i < std::min(line.size(), begin + piece); i++)
+            {
+                points.push_back(screen(line[i]));
+            }
+            list->AddPolyline(points.data(), static_cast<int>(points.size()), color, ImDrawFlags_None, thickness);
         }
-        vec2_t r = p - c.pos;
-        vec2_t rhat = glm::normalize(r);
-        sum += c.strength / std::pow(glm::length(r), 2.0f) * rhat;
+    };
+    for (const polyline_t& line : frame.lines.equipotentials)
+    {
+        polyline(line, imColor(colors::green));
+    }
+    for (const polyline_t& line : frame.lines.field_lines)
+    {
+        polyline(line, imColor(view.line_color));
+    }
+    float length = static_cast<float>(view.head_length * pixel_scale), depth = static_cast<float>(view.head_thickness * pixel_scale);
+    for (auto [pos, dir] : frame.lines.arrows)
+    {
+        ImVec2 tip = screen(pos);
+        auto [a, b, c] = arrowHead(vec2_t(tip.x, tip.y), dir, length, depth);
+        list->AddTriangleFilled(ImVec2(a.x, a.y), ImVec2(b.x, b.y), ImVec2(c.x, c.y), imColor(colors::black));
     }
-    return k * sum;
 }
 
-void render(std::span<color_t>& pixels)
+// The last frames' values of one quantity, for the timing plots
+struct history_t
 {
-    auto vecs = std::vector<vec2_t>(deltay * deltax);
-    vec2_t max(std::numeric_limits<float>::min()), min(std::numeric_limits<float>::max());
-    vec2_t delta = max - min;
-    for (size_t pos = 0; pos < pixels.size(); pos++)
+    static constexpr size_t length = 240;
+    std::array<float, length> values{};
+    size_t count = 0, next = 0;
+
+    void push(float v)
     {
-        pixels[pos] = colors::white;
+        values[next] = v;
+        next = (next + 1) % length;
+        count = std::min(count + 1, length);
     }
-    if (equipotential)
-    {
 
-        for (charge_t c : charges)
+    // Plot with min / avg / p99 over the recorded frames as the overlay
+    void plot(const char* label, const char* unit) const
+    {
+        std::array<float, length> sorted;
+        std::copy_n(values.begin(), count, sorted.begin());
+        std::sort(sorted.begin(), sorted.begin() + count);
+        float sum = 0;
+        for (size_t i = 0; i < count; i++)
         {
-            for (int k = 1; k <= ring_count; k++)
-            {
-                vec2_t p = c.pos + (static_cast<float>(k) * equipotential_dist) * glm::normalize(c.pos);
-                for (int j = 0; j < equipotential_t; j++)
-                {
-                    vec2_t force = forceAt(p);
-                    vec2_t p2 = p + glm::normalize(force);
-                    vec2_t tangent = glm::normalize(p2 - p);
-                    vec2_t normal(-tangent.y, tangent.x);
-                    size_t pos = static_cast<size_t>(p.y - ymin) * deltax + static_cast<size_t>(p.x - xmin);
-                    if (p.y >= ymin && p.y < ymax && p.x >= xmin && p.x < xmax && pos < pixels.size())
-                    {
-                        pixels[pos] = colors::green;
-                    }
-                    // // If symmetry about x axis:
-                    // size_t pos2 = static_cast<size_t>(-p.y - ymin) * deltax + static_cast<size_t>(p.x - xmin);
-                    // if (-p.y >= ymin && -p.y < ymax && p.x >= xmin && p.x < xmax)
-                    // {
-                    //     pixels[pos2] = colors::green;
-                    // }
-                    p += equi_scale * normal;
-                }
-            }
+            sum += sorted[i];
         }
-    }
-    if (fieldlines)
-    {
-        for (charge_t c : charges)
+        char overlay[96];
+        if (count)
         {
-            for (int i = 1; i <= num_lines; i++)
-            {
-                float theta = i * (2 * std::numbers::pi) / num_lines;
-                vec2_t p = c.pos + line_dist * vec2_t(std::cos(theta), std::sin(theta));
-                if (std::ranges::find_if(
-                        charges,
-                        [=](charge_t c2)
-                        {
-                            if ((c.pos != c2.pos) && ((c.strength < 0 && c2.strength < 0) || (c.strength > 0 && c2.strength > 0)))
-                            {
-                                vec2_t v1 = glm::normalize(p - c.pos), v2 = glm::normalize(c2.pos - c.pos);
-                                return std::abs(v1.x - v2.x) < FLOAT_EPSILON && std::abs(v1.y - v2.y) < FLOAT_EPSILON;
-                            }
-                            return false;
-                        }) != std::cend(charges))
-                {
-                    continue;
-                }
-                size_t t = 0;
-                for (vec2_t force = forceAt(p); force != vec2_t(0.0f) && !(p.x < xmin || p.x > xmax || p.y < ymin || p.y > ymax) && t < tmax;
-                     p += (c.strength > 0 ? 1.0f : -1.0f) * glm::normalize(force), t++)
-                {
-                    if (symmetry && std::ranges::find_if(
-                                        charges,
-                                        [=](charge_t c2)
-                                        {
-                                            if (c.pos != c2.pos)
-                                            {
-                                                return glm::distance(c.pos, p) > glm::distance(c2.pos, p);
-                                            }
-                                            return false;
-                                        }) != std::cend(charges))
-                    {
-                        continue;
-                    }
-                    size_t pos = static_cast<size_t>(p.y - ymin) * deltax + static_cast<size_t>(p.x - xmin);
-                    force = forceAt(p);
-                    if (arrows && t == arrow_distance)
-                    {
-                        vec2_t p2 = p + glm::normalize(force);
-                        vec2_t tangent = glm::normalize(p2 - p);
-                        float phi = 5.0f * static_cast<float>(std::numbers::pi) / 4.0f;
-                        float s = std::sin(phi);
-                        float c = std::cos(phi);
-                        glm::mat<2, 2, float> m{c, -s, s, c};  // rotation matrix
-                        glm::mat<2, 2, float> m2{c, s, -s, c}; // rotation matrix
-                        for (int t = 0; t < head_thickness; t++)
-                        {
-                            for (int l = 0; l < head_length; l++)
-                            {
-                                vec2_t p3 = p + static_cast<float>(l) * m * tangent + static_cast<float>(t) * tangent;
-                                vec2_t p4 = p + static_cast<float>(l) * m2 * tangent + static_cast<float>(t) * tangent;
-                                size_t pos1 = static_cast<size_t>(p3.y - ymin) * deltax + static_cast<size_t>(p3.x - xmin);
-                                if (pos1 < pixels.size())
-                                {
-                                    pixels[pos1] = colors::black;
-                                }
-                                size_t pos2 = static_cast<size_t>(p4.y - ymin) * deltax + static_cast<size_t>(p4.x - xmin);
-                                if (pos < pixels.size())
-                                {
-                                    pixels[pos2] = colors::black;
-                                }
-                            }
-                        }
-                        continue;
-                    }
-                    if (pos < pixels.size())
-                    {
-                        pixels[pos] = line_color;
-                    }
-                }
-            }
+            snprintf(overlay, sizeof(overlay), "min %.2f  avg %.2f  p99 %.2f %s", sorted[0], sum / count, sorted[(count - 1) * 99 / 100], unit);
         }
-    }
-    for (charge_t c : charges)
-    {
-        const std::array<glm::ivec2, 9> kernel = {{{0, 0}, {1, 0}, {1, 1}, {0, 1}, {-1, 1}, {-1, 0}, {-1, -1}, {0, -1}, {1, -1}}};
-        for (glm::ivec2 p : kernel)
+        else
         {
-            size_t pos = (c.pos.y + p.y - ymin) * deltax + c.pos.x + p.x - xmin;
-            if (pos < pixels.size())
-            {
-                pixels[pos] = c.strength > 0 ? colors::red : colors::blue;
-            }
+            snprintf(overlay, sizeof(overlay), "no frames yet");
         }
+        // Oldest value first once the ring has wrapped
+        ImGui::PlotLines(label, values.data(), static_cast<int>(count), count == length ? static_cast<int>(next) : 0, overlay, 0.0f, FLT_MAX, ImVec2(0, 40));
     }
-}
+};
 
 int main(int argc, char** argv)
 {
     bool quit = false;
     SDL_Event event;
 
+    char scene_path[256] = "scene.gsc";
+    std::string scene_error;
+    char export_path[256] = "out.png";
+    int32_t export_scale = 1;
+    int32_t png_level = 6;
+    // Every full frame is queued as prefix_00000.qoi and on while recording
+    char record_prefix[256] = "frame";
+    bool recording = false;
+    int32_t recorded = 0;
+    if (argc > 1)
+    {
+        scene_t scene;
+        if (!loadScene(argv[1], scene, scene_error))
+        {
+            printf("Error: %s\n", scene_error.c_str());
+            return -1;
+        }
+        charges = std::move(scene.charges);
+        settings = scene.settings;
+        snprintf(scene_path, sizeof(scene_path), "%s", argv[1]);
+    }
+
     // Setup SDL
     if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER) != 0)
     {
@@ -230,7 +181,8 @@ int main(int argc, char** argv)
         return -1;
     }
 
-    SDL_Window* window = SDL_CreateWindow("Gauss' law", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, PIXEL_SCALE * deltax, PIXEL_SCALE * deltay, 0);
+    SDL_Window* window = SDL_CreateWindow("Gauss' law", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, pixel_scale * settings.width, pixel_scale * settings.height,
+                                          SDL_WINDOW_RESIZABLE);
 
     SDL_Renderer* renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_TARGETTEXTURE | SDL_RENDERER_PRESENTVSYNC | SDL_RENDERER_ACCELERATED);
 
@@ -244,15 +196,72 @@ int main(int argc, char** argv)
     ImGui_ImplSDL2_InitForSDLRenderer(window, renderer);
     ImGui_ImplSDLRenderer2_Init(renderer);
 
-    SDL_Surface* image = SDL_CreateRGBSurface(0, deltax, deltay, 32, 0, 0, 0, 0);
-    SDL_Texture* texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ABGR8888, SDL_TEXTUREACCESS_STREAMING, deltax, deltay);
+    // Recreated only when a frame of a different size arrives
+    SDL_Texture* texture = nullptr;
+    int32_t texture_width = 0, texture_height = 0;
+
+    // The scene renders on its own thread, the loop below only uploads frames it finished. Images are
+    // written on another. Both post wake_event when they finish something, which wakes the loop if it is idle.
+    Uint32 wake_event = SDL_RegisterEvents(1);
+    auto wake = [wake_event]
+    {
+        SDL_Event ready{};
+        ready.type = wake_event;
+        SDL_PushEvent(&ready);
+    };
+    render_thread_t render_thread(wake);
+    export_queue_t export_queue(wake);
+    frame_t frame;
+    render_settings_t requested_settings;
+    // What the render thread was last handed, replaced only when the charges change
+    std::shared_ptr<const charges_t> requested_charges;
+
+    std::array<history_t, static_cast<size_t>(stage_t::count)> stage_history;
+    history_t frame_history, evaluation_history;
 
     bool rerender = true;
     bool live = true;
+    // Live edits show a quick coarse frame first, the full one follows unless another edit cancels it
+    bool progressive = true;
+    bool measure_error = false;
+    fmm_t::error_t fmm_error;
+    // Frames still to draw before the loop goes idle. ImGui settles hover and layout over a couple of
+    // frames after an input, so every event keeps the loop going for a few.
+    const int32_t settle_frames = 3;
+    int32_t active_frames = settle_frames;
     while (!quit)
     {
-        void* ptr;
-        int pitch = sizeof(color_t) * deltax;
+        // Idle until input or a finished frame arrives. The timeout keeps text cursors and the status line
+        // ticking over, a hidden or minimized window has nothing to show and only wakes for events.
+        bool hidden = SDL_GetWindowFlags(window) & (SDL_WINDOW_HIDDEN | SDL_WINDOW_MINIMIZED);
+        if (hidden)
+        {
+            SDL_WaitEvent(NULL);
+        }
+        else if (active_frames == 0)
+        {
+            // Often enough to move the progress bar of a running export
+            SDL_WaitEventTimeout(NULL, export_queue.busy() ? 100 : 500);
+        }
+        while (SDL_PollEvent(&event))
+        {
+            ImGui_ImplSDL2_ProcessEvent(&event);
+            active_frames = settle_frames;
+            if (event.type == SDL_QUIT)
+                quit = true;
+            if (event.type == SDL_WINDOWEVENT && event.window.event == SDL_WINDOWEVENT_CLOSE && event.window.windowID == SDL_GetWindowID(window))
+                quit = true;
+            if (event.type == SDL_MOUSEMOTION)
+            {
+                cursor_pos.x = event.motion.x / pixel_scale;
+                cursor_pos.y = event.motion.y / pixel_scale;
+            }
+        }
+        if (hidden || quit)
+        {
+            continue;
+        }
+        active_frames = std::max(0, active_frames - 1);
 
         ImGui_ImplSDLRenderer2_NewFrame();
         ImGui_ImplSDL2_NewFrame();
@@ -260,79 +269,310 @@ int main(int argc, char** argv)
 
         ImGui::Begin("controls");
         ImGui::Text("Application average %.3f ms/frame (%.1f FPS)", 1000.0f / io.Framerate, io.Framerate);
+        ImGui::Text("Field kernel: %s", forceKernelName());
 
-        if (rerender || live)
+        bool edited = !requested_charges || charges.version != requested_charges->version;
+        if (rerender || measure_error || (live && (settings != requested_settings || edited)))
         {
-            SDL_LockTexture(texture, NULL, &ptr, &pitch);
-            auto pixels = std::span<color_t>(static_cast<color_t*>(ptr), deltax * deltay);
-            render(pixels);
-            SDL_UnlockTexture(texture);
+            // Panning and setting changes share the last snapshot, only edits pay for a copy
+            if (edited)
+            {
+                requested_charges = std::make_shared<const charges_t>(charges);
+            }
+            render_thread.request(requested_charges, settings, measure_error, live && progressive && !rerender);
+            requested_settings = settings;
             rerender = false;
+            measure_error = false;
         }
-
-        while (SDL_PollEvent(&event))
+        if (render_thread.fetch(frame))
         {
-            ImGui_ImplSDL2_ProcessEvent(&event);
-            if (event.type == SDL_QUIT)
-                quit = true;
-            if (event.type == SDL_WINDOWEVENT && event.window.event == SDL_WINDOWEVENT_CLOSE && event.window.windowID == SDL_GetWindowID(window))
-                quit = true;
-            if (event.type == SDL_MOUSEMOTION)
+            if (frame.width != texture_width || frame.height != texture_height)
+            {
+                SDL_DestroyTexture(texture);
+                texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ABGR8888, SDL_TEXTUREACCESS_STREAMING, frame.width, frame.height);
+                texture_width = frame.width;
+                texture_height = frame.height;
+            }
+            SDL_UpdateTexture(texture, NULL, frame.pixels.data(), frame.width * static_cast<int>(sizeof(color_t)));
+            if (recording && frame.coarse == 1)
+            {
+                // Frames the queue has no room for are dropped, the numbering stays without gaps
+                char name[300];
+                snprintf(name, sizeof(name), "%s_%05d.qoi", record_prefix, recorded);
+                if (export_queue.record(frame.pixels, frame.width, frame.height, name))
+                {
+                    recorded++;
+                }
+            }
+            if (frame.fmm_error.samples)
+            {
+                fmm_error = frame.fmm_error;
+            }
+            // Previews would drag the timings down
+            if (frame.coarse == 1)
             {
-                cursor_pos.x = event.motion.x / PIXEL_SCALE;
-                cursor_pos.y = event.motion.y / PIXEL_SCALE;
+                for (size_t i = 0; i < stage_history.size(); i++)
+                {
+                    stage_history[i].push(static_cast<float>(frame.stats.stage_milliseconds[i]));
+                }
+                frame_history.push(static_cast<float>(frame.stats.milliseconds));
+                evaluation_history.push(static_cast<float>(frame.stats.force_evaluations));
+            }
+        }
+        ImGui::Text("Scene rendered in %.1f ms%s%s", frame.stats.milliseconds, frame.coarse > 1 ? " (preview)" : "", render_thread.busy() ? ", rendering..." : "");
+        if (ImGui::CollapsingHeader("Timings"))
+        {
+            frame_history.plot("Frame", "ms");
+            for (size_t i = 0; i < stage_history.size(); i++)
+            {
+                stage_history[i].plot(stage_names[i], "ms");
             }
+            ImGui::Text("%llu forceAt / potentialAt evaluations last frame", static_cast<unsigned long long>(frame.stats.force_evaluations));
+            evaluation_history.plot("forceAt calls", "");
         }
 
-        ImGui::Checkbox("Clip force lines", &symmetry);
+        fitToWindow(window);
+
+        ImGui::SeparatorText("View");
+        ImGui::SliderInt("pixel scale", &pixel_scale, 1, 8);
+        float zoom = settings.zoom;
+        if (ImGui::SliderFloat("zoom", &zoom, 0.125f, 16.0f, "%.3f", ImGuiSliderFlags_Logarithmic) && zoom > 0)
+        {
+            setView(settings.width, settings.height, zoom);
+        }
+        ImGui::Text("%dx%d pixels, x %.1f..%.1f, y %.1f..%.1f", settings.width, settings.height, settings.lo().x, settings.hi().x, settings.lo().y, settings.hi().y);
+        ImGui::Checkbox("Draw lines on the GPU", &settings.vector_lines);
+        ImGui::Checkbox("Clip force lines", &settings.symmetry);
         ImGui::SeparatorText("Field Lines");
-        ImGui::Checkbox("Emable Field Lines", &fieldlines);
-        if (fieldlines)
+        ImGui::Checkbox("Emable Field Lines", &settings.fieldlines);
+        if (settings.fieldlines)
         {
-            ImGui::SliderInt("NumLines", &num_lines, 0, 32);
-            ImGui::SliderInt("tmax", &tmax, 0, 1000);
-            ImGui::Checkbox("Enable Arrows", &arrows);
-            if (arrows)
+            ImGui::SliderInt("NumLines", &settings.num_lines, 0, 32);
+            ImGui::SliderInt("tmax", &settings.tmax, 0, 1000);
+            ImGui::Combo("integrator", reinterpret_cast<int*>(&settings.trace.integrator), integrator_names, IM_ARRAYSIZE(integrator_names));
+            if (settings.trace.integrator == integrator_t::rk45)
+            {
+                ImGui::SliderFloat("tolerance", &settings.trace.tolerance, 1e-4f, 1.0f, "%.4f", ImGuiSliderFlags_Logarithmic);
+            }
+            else
+            {
+                ImGui::SliderFloat("step", &settings.trace.step, 0.1f, 5.0f);
+            }
+            ImGui::Text("%zu field evaluations last frame", frame.stats.field_evaluations);
+            ImGui::Checkbox("Enable Arrows", &settings.arrows);
+            if (settings.arrows)
             {
-                ImGui::SliderInt("distance", &arrow_distance, 0, 100);
-                ImGui::SliderInt("head length", &head_length, 0, 10);
-                ImGui::SliderInt("head thickness", &head_thickness, 0, 5);
+                ImGui::SliderInt("distance", &settings.arrow_distance, 0, 100);
+                ImGui::SliderInt("head length", &settings.head_length, 0, 10);
+                ImGui::SliderInt("head thickness", &settings.head_thickness, 0, 5);
             }
         }
         ImGui::SeparatorText("Equipotential Lines");
-        ImGui::Checkbox("Enable Equipotential Lines", &equipotential);
-        if (equipotential)
+        ImGui::Checkbox("Enable Equipotential Lines", &settings.equipotential);
+        if (settings.equipotential)
+        {
+            ImGui::SliderInt("ring count", &settings.ring_count, 0, 10);
+            ImGui::SliderInt("equi dist", &settings.equipotential_dist, 1, 100);
+            ImGui::SliderFloat("equi spacing", &settings.equipotential_spacing, 0.25f, 4.0f);
+        }
+        ImGui::SeparatorText("Heat Map");
+        ImGui::Checkbox("Enable Heat Map", &settings.fieldcolor);
+        if (settings.fieldcolor)
+        {
+            ImGui::Combo("quantity", reinterpret_cast<int*>(&settings.heat_quantity), heat_quantity_names, IM_ARRAYSIZE(heat_quantity_names));
+            ImGui::Combo("scale", reinterpret_cast<int*>(&settings.heat_scale), heat_scale_names, IM_ARRAYSIZE(heat_scale_names));
+            ImGui::Combo("colormap", reinterpret_cast<int*>(&settings.colormap), colormap_names, IM_ARRAYSIZE(colormap_names));
+        }
+        ImGui::SeparatorText("Solver");
+        ImGui::Combo("method", reinterpret_cast<int*>(&settings.method), method_names, IM_ARRAYSIZE(method_names));
+        if (settings.method == method_t::barnes_hut)
+        {
+            ImGui::SliderFloat("theta", &settings.theta, 0.0f, 1.0f);
+            ImGui::Text("%zu nodes, last update moved %lld charges", frame.stats.tree_nodes, static_cast<long long>(frame.stats.tree_moves));
+        }
+        if (settings.method == method_t::fmm)
+        {
+            ImGui::SliderInt("order", &settings.fmm_order, 1, fmm_t::max_order);
+            ImGui::Text("%d levels, built in %.1f ms", frame.stats.fmm_levels, frame.stats.fmm_milliseconds);
+            if (ImGui::Button("Measure error"))
+            {
+                measure_error = true;
+            }
+            if (fmm_error.samples)
+            {
+                ImGui::Text("vs direct over %zu points: rms %.2e, max %.2e", fmm_error.samples, fmm_error.rms, fmm_error.max);
+            }
+        }
+        ImGui::Checkbox("Cache field grid", &settings.use_grid);
+        if (settings.use_grid)
         {
-            ImGui::SliderInt("ring count", &ring_count, 0, 10);
-            ImGui::SliderInt("equi tmax", &equipotential_t, 0, 10000);
-            ImGui::SliderFloat("equi scale", &equi_scale, 0.0f, 1.0f);
-            ImGui::SliderInt("equi dist", &equipotential_dist, 1, 100);
+            ImGui::SliderFloat("grid spacing", &settings.grid_spacing, 0.25f, 8.0f);
+            ImGui::Combo("interpolation", reinterpret_cast<int*>(&settings.interpolation), interpolation_names, IM_ARRAYSIZE(interpolation_names));
+            ImGui::Text("%dx%d nodes, built in %.1f ms", frame.stats.grid_width, frame.stats.grid_height, frame.stats.grid_milliseconds);
+        }
+        // A single point, the direct sum is cheap enough here and keeps the solver on the render thread
+        vec2_t probe = settings.origin + vec2_t(cursor_pos) / settings.zoom;
+        vec2_t force = forceAt(charges, probe);
+        ImGui::Text("Force under cursor, x:%d, y:%d,\n %.3fi+%.3fj\n magnitude:%.3f", static_cast<int>(probe.x), static_cast<int>(probe.y), force.x, force.y,
+                    glm::length(force));
+        ImGui::SeparatorText("Scene");
+        ImGui::InputText("file", scene_path, sizeof(scene_path));
+        if (ImGui::Button("Load"))
+        {
+            scene_t scene;
+            if (loadScene(scene_path, scene, scene_error))
+            {
+                // The window keeps its size, only the startup scene picks it
+                scene.settings.width = settings.width;
+                scene.settings.height = settings.height;
+                charges = std::move(scene.charges);
+                settings = scene.settings;
+                scene_error.clear();
+            }
+        }
+        ImGui::SameLine();
+        if (ImGui::Button("Save") && saveScene(scene_path, charges, settings, scene_error))
+        {
+            scene_error.clear();
+        }
+        if (!scene_error.empty())
+        {
+            ImGui::TextColored(ImVec4(1.0f, 0.3f, 0.3f, 1.0f), "%s", scene_error.c_str());
         }
-        vec2_t force = forceAt(cursor_pos + glm::vec<2, int32_t>(xmin, ymin));
-        ImGui::Text(
-            "Force under cursor, x:%d, y:%d,\n %.3fi+%.3fj\n magnitude:%.3f", cursor_pos.x + xmin, cursor_pos.y + ymin, force.x, force.y, glm::length(force));
         ImGui::SeparatorText("Charges");
-        for (auto& c : charges)
+        if (ImGui::Button("Add charge"))
+        {
+            charges.add({vec2_t(0.0f), 20.0f});
+        }
+        ImGui::SameLine();
+        ImGui::Text("%zu charges", charges.size());
+        std::optional<size_t> removed;
+        ImGui::BeginChild("charge list", ImVec2(0, 300), true);
+        ImGuiListClipper clipper;
+        clipper.Begin(static_cast<int>(charges.size()));
+        while (clipper.Step())
+        {
+            for (int i = clipper.DisplayStart; i < clipper.DisplayEnd; i++)
+            {
+                ImGui::PushID(i);
+                if (ImGui::DragFloat("charge", &charges.strength[i], 1.0f, -100.0f, 100.0f))
+                {
+                    charges.touch();
+                }
+                vec2_t pos = charges.pos(i);
+                if (ImGui::DragFloat2("position", static_cast<float*>(glm::value_ptr(pos))))
+                {
+                    charges.x[i] = pos.x;
+                    charges.y[i] = pos.y;
+                    charges.touch();
+                }
+                if (ImGui::SmallButton("Remove"))
+                {
+                    removed = i;
+                }
+                ImGui::PopID();
+            }
+        }
+        ImGui::EndChild();
+        if (removed)
         {
-            ImGui::PushID(&c);
-            ImGui::DragFloat("charge", &c.strength, 1.0f, -100.0f, 100.0f);
-            ImGui::DragFloat2("position", static_cast<float*>(glm::value_ptr(c.pos)));
-            ImGui::PopID();
+            charges.remove(*removed);
         }
         rerender = ImGui::Button("Render");
         ImGui::Checkbox("Live Update", &live);
-        if (ImGui::Button("Save to .png"))
+        ImGui::SameLine();
+        ImGui::Checkbox("Preview first", &progressive);
+        ImGui::SeparatorText("Export");
+        // The same view at export_scale times the resolution, written in the background. At scale 1 the frame
+        // on screen is saved as it is, larger images are drawn in tiles straight into the file.
+        ImGui::InputText("image", export_path, sizeof(export_path));
+        ImGui::SliderInt("scale", &export_scale, 1, 256, "%d", ImGuiSliderFlags_Logarithmic);
+        render_settings_t exported = settings;
+        exported.width = settings.width * export_scale;
+        exported.height = settings.height * export_scale;
+        exported.zoom = settings.zoom * export_scale;
+        ImGui::SliderInt("png level", &png_level, 0, 9);
+        ImGui::Text("%dx%d pixels", exported.width, exported.height);
+        if (ImGui::Button("Export"))
         {
-            int width = deltax, height = deltay;
-            SDL_Surface* surface = SDL_CreateRGBSurface(0, width, height, 32, 0x000000FF, 0x0000FF00, 0x00FF0000, 0x00000000);
-            auto pixels = std::span<color_t>(static_cast<color_t*>(surface->pixels), deltax * deltay);
-            render(pixels);
-            IMG_SavePNG(surface, "out.png");
-            SDL_FreeSurface(surface);
+            // .svg and .pdf get vector paths, anything else a PNG
+            std::string_view path = export_path;
+            bool vector = path.ends_with(".svg") || path.ends_with(".pdf");
+            // Previews and frames whose lines are drawn on the GPU are not what the file should show
+            if (!vector && export_scale == 1 && frame.coarse == 1 && !frame.settings.vector_lines && !frame.pixels.empty())
+            {
+                export_queue.save(frame.pixels, frame.width, frame.height, export_path, png_level);
+            }
+            else
+            {
+                export_queue.render(charges, exported, export_path, png_level);
+            }
+        }
+        // Lossless frame dumps, fast enough to keep up with rendering. headless --convert makes PNGs of them.
+        ImGui::InputText("frames", record_prefix, sizeof(record_prefix));
+        if (ImGui::Checkbox("Record frames", &recording) && recording)
+        {
+            recorded = 0;
+        }
+        if (recording)
+        {
+            ImGui::SameLine();
+            ImGui::Text("%d recorded", recorded);
+        }
+        // Exports are few, a recording's frames are only counted by the queue
+        export_queue_t::frames_t frames = export_queue.frames();
+        if (recording || frames.written || frames.dropped)
+        {
+            ImGui::Text("Frames: %zu written, %zu queued, %zu dropped", frames.written, frames.queued, frames.dropped);
+        }
+        if (frames.failed)
+        {
+            ImGui::TextColored(ImVec4(1.0f, 0.3f, 0.3f, 1.0f), "%zu frames failed: %s", frames.failed, frames.error.c_str());
+        }
+        size_t queued = 0, saved = 0, failed = 0;
+        std::string last_saved;
+        for (const export_queue_t::status_t& status : export_queue.status())
+        {
+            switch (status.state)
+            {
+            case export_queue_t::state_t::queued:
+                queued++;
+                break;
+            case export_queue_t::state_t::writing:
+                ImGui::ProgressBar(status.progress, ImVec2(-FLT_MIN, 0), status.path.c_str());
+                break;
+            case export_queue_t::state_t::done:
+                saved++;
+                last_saved = status.path;
+                break;
+            case export_queue_t::state_t::failed:
+                failed++;
+                ImGui::TextColored(ImVec4(1.0f, 0.3f, 0.3f, 1.0f), "%s: %s", status.path.c_str(), status.error.c_str());
+                break;
+            }
+        }
+        if (queued)
+        {
+            ImGui::Text("%zu queued", queued);
+        }
+        if (saved)
+        {
+            ImGui::Text("Saved %s%s", last_saved.c_str(), saved > 1 ? (" and " + std::to_string(saved - 1) + " more").c_str() : "");
+        }
+        if ((saved || failed || frames.written || frames.failed || frames.dropped) && ImGui::Button("Clear"))
+        {
+            export_queue.clearFinished();
         }
         ImGui::End();
 
-        SDL_RenderCopy(renderer, texture, NULL, NULL);
+        // Stretched by exactly pixel_scale so cursor positions map back onto frame pixels
+        SDL_Rect target = {0, 0, texture_width * pixel_scale, texture_height * pixel_scale};
+        SDL_RenderCopy(renderer, texture, NULL, &target);
+        if (frame.settings.vector_lines)
+        {
+            // The background list is drawn first, on top of the texture and under the controls
+            drawLineLayer(ImGui::GetBackgroundDrawList(), frame);
+        }
 
         // Rendering
         ImGui::Render();
@@ -346,7 +586,6 @@ int main(int argc, char** argv)
     ImGui::DestroyContext();
 
     SDL_DestroyTexture(texture);
-    SDL_FreeSurface(image);
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
 
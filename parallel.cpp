@@ -0,0 +1,180 @@
+#include "parallel.h"
+#include <algorithm>
+#include <utility>
+
+namespace
+{
+    thread_local bool inside_pool = false;
+    thread_local thread_pool_t* scoped_pool = nullptr;
+}
+
+thread_pool_t::thread_pool_t(size_t threads)
+{
+    for (size_t i = 1; i < threads; i++)
+    {
+        workers.emplace_back([this] { loop(); });
+    }
+}
+
+thread_pool_t::~thread_pool_t()
+{
+    {
+        std::lock_guard lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+}
+
+void thread_pool_t::run(size_t count, size_t grain, const std::function<void(size_t, size_t)>& fn)
+{
+    grain = std::max<size_t>(grain, 1);
+    if (count <= grain || workers.empty() || inside_pool || !submit.try_lock())
+    {
+        if (count > 0)
+        {
+            fn(0, count);
+        }
+        return;
+    }
+    std::lock_guard submitted(submit, std::adopt_lock);
+    job_t current{.fn = &fn, .grain = grain, .shares = std::make_unique<share_t[]>(size()), .share_count = size()};
+    for (size_t s = 0; s < current.share_count; s++)
+    {
+        current.shares[s].begin = count * s / current.share_count;
+        current.shares[s].end = count * (s + 1) / current.share_count;
+    }
+    {
+        std::lock_guard lock(mutex);
+        job = &current;
+        generation++;
+    }
+    wake.notify_all();
+    inside_pool = true;
+    work(current, 0);
+    inside_pool = false;
+    std::unique_lock lock(mutex);
+    done.wait(lock, [this] { return busy == 0; });
+    // Workers that wake up from now on see no job and go back to sleep
+    job = nullptr;
+}
+
+void thread_pool_t::loop()
+{
+    inside_pool = true;
+    uint64_t seen = 0;
+    std::unique_lock lock(mutex);
+    while (true)
+    {
+        wake.wait(lock, [&] { return stopping || generation != seen; });
+        if (stopping)
+        {
+            return;
+        }
+        seen = generation;
+        if (!job)
+        {
+            continue;
+        }
+        job_t* current = job;
+        busy++;
+        lock.unlock();
+        size_t share = current->next_share.fetch_add(1);
+        if (share < current->share_count)
+        {
+            work(*current, share);
+        }
+        lock.lock();
+        if (--busy == 0)
+        {
+            done.notify_all();
+        }
+    }
+}
+
+void thread_pool_t::work(job_t& job, size_t share)
+{
+    share_t& own = job.shares[share];
+    while (true)
+    {
+        size_t begin, end;
+        {
+            std::lock_guard lock(own.mutex);
+            begin = own.begin;
+            end = std::min(own.begin + job.grain, own.end);
+            own.begin = end;
+        }
+        if (begin < end)
+        {
+            (*job.fn)(begin, end);
+            continue;
+        }
+
+        // Own share is exhausted, steal the back half of the fullest one
+        size_t victim = job.share_count, most = 0;
+        for (size_t s = 0; s < job.share_count; s++)
+        {
+            std::lock_guard lock(job.shares[s].mutex);
+            size_t left = job.shares[s].end - job.shares[s].begin;
+            if (left > most)
+            {
+                most = left;
+                victim = s;
+            }
+        }
+        if (victim == job.share_count)
+        {
+            return;
+        }
+        {
+            std::lock_guard lock(job.shares[victim].mutex);
+            share_t& other = job.shares[victim];
+            if (other.begin >= other.end)
+            {
+                continue;
+            }
+            size_t middle = other.end - other.begin <= job.grain ? other.begin : other.begin + (other.end - other.begin) / 2;
+            begin = middle;
+            end = other.end;
+            other.end = middle;
+        }
+        std::lock_guard lock(own.mutex);
+        own.begin = begin;
+        own.end = end;
+    }
+}
+
+thread_pool_t& pool()
+{
+    if (scoped_pool)
+    {
+        return *scoped_pool;
+    }
+    static thread_pool_t instance(std::max(1u, std::thread::hardware_concurrency()));
+    return instance;
+}
+
+pool_scope_t::pool_scope_t(thread_pool_t& pool) : previous(std::exchange(scoped_pool, &pool))
+{
+}
+
+pool_scope_t::~pool_scope_t()
+{
+    scoped_pool = previous;
+}
+
+uint64_t sharded_counter_t::total() const
+{
+    uint64_t sum = 0;
+    for (const shard_t& s : shards)
+    {
+        sum += s.value.load(std::memory_order_relaxed);
+    }
+    return sum;
+}
+
+size_t sharded_counter_t::shard()
+{
+    static std::atomic<size_t> next = 0;
+    thread_local size_t index = next.fetch_add(1) % std::tuple_size_v<decltype(shards)>;
+    return index;
+}
@@ -0,0 +1,94 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Persistent worker threads shared by every parallel stage. The submitting thread works too.
+// Each participant starts on its own contiguous share of the range and, once that runs out, steals
+// the back half of whichever share has the most left, so uneven items (long field lines next to short
+// ones) still balance. A job submitted while another one is running, or from inside a job, runs
+// serially on the caller instead of waiting, so stages can nest without deadlocking. A thread that
+// works alongside another submitter, like the exporter next to the renderer, gets a pool of its own
+// through pool_scope_t rather than queueing behind it.
+class thread_pool_t
+{
+public:
+    explicit thread_pool_t(size_t threads);
+    ~thread_pool_t();
+
+    size_t size() const { return workers.size() + 1; }
+    // Calls fn(begin, end) on chunks of at most `grain` items until [0, count) is covered
+    void run(size_t count, size_t grain, const std::function<void(size_t, size_t)>& fn);
+
+private:
+    struct share_t
+    {
+        std::mutex mutex;
+        size_t begin = 0, end = 0;
+    };
+
+    struct job_t
+    {
+        const std::function<void(size_t, size_t)>* fn;
+        size_t grain;
+        std::unique_ptr<share_t[]> shares;
+        size_t share_count;
+        std::atomic<size_t> next_share = 1;
+    };
+
+    std::vector<std::jthread> workers;
+    std::mutex mutex, submit;
+    std::condition_variable wake, done;
+    job_t* job = nullptr;
+    uint64_t generation = 0;
+    size_t busy = 0;
+    bool stopping = false;
+
+    void loop();
+    static void work(job_t& job, size_t share);
+};
+
+// The pool of the calling thread, the shared one unless a pool_scope_t says otherwise
+thread_pool_t& pool();
+
+// Makes pool(), and with it parallelFor, use another pool on the current thread while it lives
+class pool_scope_t
+{
+public:
+    explicit pool_scope_t(thread_pool_t& pool);
+    ~pool_scope_t();
+    pool_scope_t(const pool_scope_t&) = delete;
+    pool_scope_t& operator=(const pool_scope_t&) = delete;
+
+private:
+    thread_pool_t* previous;
+};
+
+// Counter that many threads can bump at once without all of them fighting over one cache line
+class sharded_counter_t
+{
+public:
+    void add(uint64_t n) { shards[shard()].value.fetch_add(n, std::memory_order_relaxed); }
+    uint64_t total() const;
+
+private:
+    struct alignas(64) shard_t
+    {
+        std::atomic<uint64_t> value = 0;
+    };
+    std::array<shard_t, 32> shards;
+
+    static size_t shard();
+};
+
+inline void parallelFor(size_t count, const std::function<void(size_t, size_t)>& fn, size_t grain = 1)
+{
+    pool().run(count, grain, fn);
+}
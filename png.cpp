@@ -0,0 +1,246 @@
+#include "png.h"
+#include "parallel.h"
+#include <algorithm>
+#include <array>
+
+namespace
+{
+    constexpr size_t chunk_size = 1 << 16;
+    // Small enough to spread a modest image over every thread, large enough that the border costs nothing
+    constexpr size_t block_size = 1 << 18;
+    // The reach of a deflate back reference
+    constexpr size_t window_size = 1 << 15;
+
+    void putBigEndian(uint8_t* p, uint32_t v)
+    {
+        p[0] = static_cast<uint8_t>(v >> 24);
+        p[1] = static_cast<uint8_t>(v >> 16);
+        p[2] = static_cast<uint8_t>(v >> 8);
+        p[3] = static_cast<uint8_t>(v);
+    }
+} // namespace
+
+bool png_writer_t::open(const std::string& path, int32_t width, int32_t height, int level, std::string& error)
+{
+    if (width <= 0 || height <= 0)
+    {
+        error = "empty image";
+        return false;
+    }
+    if (level < 0 || level > 9)
+    {
+        error = "compression level must be 0 to 9";
+        return false;
+    }
+    out.open(path, std::ios::binary);
+    if (!out)
+    {
+        error = "cannot write " + path;
+        return false;
+    }
+    this->path = path;
+    this->width = width;
+    this->height = height;
+    this->level = level;
+    rows = 0;
+    started = true;
+    previous.assign(3 * static_cast<size_t>(width), 0);
+    window.clear();
+    pending.clear();
+    buffer.clear();
+    adler = adler32(0, Z_NULL, 0);
+
+    const uint8_t signature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    out.write(reinterpret_cast<const char*>(signature), sizeof(signature));
+    std::array<uint8_t, 13> header{};
+    putBigEndian(&header[0], static_cast<uint32_t>(width));
+    putBigEndian(&header[4], static_cast<uint32_t>(height));
+    header[8] = 8;  // bits per sample
+    header[9] = 2;  // RGB
+    writeChunk("IHDR", header);
+    // zlib header for a 32 KiB window, the second byte names the level and makes the pair a multiple of 31
+    const uint8_t zlib_header[] = {0x78, static_cast<uint8_t>(level < 2 ? 0x01 : level < 6 ? 0x5E : level == 6 ? 0x9C : 0xDA)};
+    writeData(zlib_header);
+    return true;
+}
+
+bool png_writer_t::write(std::span<const color_t> pixels, std::string& error)
+{
+    size_t row_size = 1 + previous.size();
+    for (size_t begin = 0; begin + width <= pixels.size(); begin += width)
+    {
+        if (rows == height)
+        {
+            error = "more rows than the image has";
+            return false;
+        }
+        // Up filter, each byte minus the one above it, so flat vertical runs become zeros
+        pending.resize(pending.size() + row_size);
+        uint8_t* row = pending.data() + pending.size() - row_size;
+        row[0] = 2;
+        for (int32_t x = 0; x < width; x++)
+        {
+            color_t c = pixels[begin + x];
+            uint8_t* p = &row[1 + 3 * static_cast<size_t>(x)];
+            uint8_t* above = &previous[3 * static_cast<size_t>(x)];
+            p[0] = static_cast<uint8_t>(c.x - above[0]);
+            p[1] = static_cast<uint8_t>(c.y - above[1]);
+            p[2] = static_cast<uint8_t>(c.z - above[2]);
+            above[0] = c.x;
+            above[1] = c.y;
+            above[2] = c.z;
+        }
+        rows++;
+    }
+    // Waits for a block per thread, so small writes still compress in parallel
+    if (pending.size() >= pool().size() * block_size)
+    {
+        return deflatePending(false, error);
+    }
+    return true;
+}
+
+bool png_writer_t::close(std::string& error)
+{
+    if (!started)
+    {
+        error = "not open";
+        return false;
+    }
+    if (rows != height)
+    {
+        error = path + " got " + std::to_string(rows) + " of " + std::to_string(height) + " rows";
+        return false;
+    }
+    if (!deflatePending(true, error))
+    {
+        return false;
+    }
+    // An empty final block ends the deflate stream, the adler32 of all filtered data ends the zlib stream
+    std::array<uint8_t, 6> trailer = {0x03, 0x00};
+    putBigEndian(&trailer[2], static_cast<uint32_t>(adler));
+    writeData(trailer);
+    writeChunk("IDAT", buffer);
+    buffer.clear();
+    started = false;
+    writeChunk("IEND", {});
+    out.close();
+    if (!out)
+    {
+        error = "failed writing " + path;
+        return false;
+    }
+    return true;
+}
+
+bool png_writer_t::deflatePending(bool last, std::string& error)
+{
+    size_t count = last ? (pending.size() + block_size - 1) / block_size : pending.size() / block_size;
+    size_t used = std::min(pending.size(), count * block_size);
+    std::vector<std::vector<uint8_t>> compressed(count);
+    std::vector<uLong> sums(count);
+    std::atomic<bool> failed = false;
+    parallelFor(count,
+                [&](size_t begin, size_t end)
+                {
+                    z_stream stream{};
+                    // Raw deflate, the zlib header and trailer are written once for the whole image
+                    if (deflateInit2(&stream, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+                    {
+                        failed = true;
+                        return;
+                    }
+                    for (size_t b = begin; b < end; b++)
+                    {
+                        std::span<uint8_t> in = std::span(pending).subspan(b * block_size, std::min(block_size, used - b * block_size));
+                        std::span<const uint8_t> dictionary = b > 0 ? std::span(pending).subspan((b - 1) * block_size + block_size - window_size, window_size) : window;
+                        deflateReset(&stream);
+                        if (!dictionary.empty())
+                        {
+                            deflateSetDictionary(&stream, dictionary.data(), static_cast<uInt>(dictionary.size()));
+                        }
+                        // A sync flush ends the block on a byte boundary, so the next block's data can follow it directly
+                        std::vector<uint8_t>& data = compressed[b];
+                        data.resize(deflateBound(&stream, static_cast<uLong>(in.size())) + 16);
+                        stream.next_in = in.data();
+                        stream.avail_in = static_cast<uInt>(in.size());
+                        stream.next_out = data.data();
+                        stream.avail_out = static_cast<uInt>(data.size());
+                        while (true)
+                        {
+                            if (deflate(&stream, Z_SYNC_FLUSH) == Z_STREAM_ERROR)
+                            {
+                                failed = true;
+                                break;
+                            }
+                            if (stream.avail_out > 0)
+                            {
+                                break;
+                            }
+                            size_t size = data.size();
+                            data.resize(2 * size);
+                            stream.next_out = data.data() + size;
+                            stream.avail_out = static_cast<uInt>(size);
+                        }
+                        data.resize(data.size() - stream.avail_out);
+                        sums[b] = adler32(adler32(0, Z_NULL, 0), in.data(), static_cast<uInt>(in.size()));
+                    }
+                    deflateEnd(&stream);
+                });
+    if (failed)
+    {
+        error = "compressor failed";
+        return false;
+    }
+    for (size_t b = 0; b < count; b++)
+    {
+        writeData(compressed[b]);
+        adler = adler32_combine(adler, sums[b], static_cast<z_off_t>(std::min(block_size, used - b * block_size)));
+    }
+    // Keep the tail as the dictionary of the next block
+    if (used > 0)
+    {
+        size_t keep = std::min(window_size, used);
+        window.assign(pending.begin() + (used - keep), pending.begin() + used);
+        pending.erase(pending.begin(), pending.begin() + used);
+    }
+    if (!out)
+    {
+        error = "failed writing " + path;
+        return false;
+    }
+    return true;
+}
+
+void png_writer_t::writeData(std::span<const uint8_t> data)
+{
+    while (!data.empty())
+    {
+        size_t n = std::min(data.size(), chunk_size - buffer.size());
+        buffer.insert(buffer.end(), data.begin(), data.begin() + n);
+        data = data.subspan(n);
+        if (buffer.size() == chunk_size)
+        {
+            writeChunk("IDAT", buffer);
+            buffer.clear();
+        }
+    }
+}
+
+void png_writer_t::writeChunk(const char* type, std::span<const uint8_t> data)
+{
+    uint8_t length[4];
+    putBigEndian(length, static_cast<uint32_t>(data.size()));
+    out.write(reinterpret_cast<const char*>(length), 4);
+    out.write(type, 4);
+    out.write(reinterpret_cast<const char*>(data.data()), static_cast<std::streamsize>(data.size()));
+    uLong crc = crc32(0, reinterpret_cast<const Bytef*>(type), 4);
+    if (!data.empty())
+    {
+        // A null buffer would restart the checksum instead of extending it
+        crc = crc32(crc, data.data(), static_cast<uInt>(data.size()));
+    }
+    uint8_t check[4];
+    putBigEndian(check, static_cast<uint32_t>(crc));
+    out.write(reinterpret_cast<const char*>(check), 4);
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include "color.h"
+#include <cstdint>
+#include <fstream>
+#include <span>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+// Writes an 8-bit RGB PNG a band of rows at a time, so an image never has to be in memory as a whole.
+// Filtered rows are cut into blocks of a fixed size that are deflated on every thread at once, each
+// primed with the 32 KiB before it, and joined into one zlib stream the way pigz does. Block borders
+// are fixed offsets into the data, so the file does not depend on the thread count.
+class png_writer_t
+{
+public:
+    png_writer_t() = default;
+    png_writer_t(const png_writer_t&) = delete;
+    png_writer_t& operator=(const png_writer_t&) = delete;
+
+    // level is the zlib compression level, 0 to 9
+    bool open(const std::string& path, int32_t width, int32_t height, int level, std::string& error);
+    // pixels holds whole rows of `width` colors, continuing where the last call stopped. Alpha is dropped.
+    bool write(std::span<const color_t> pixels, std::string& error);
+    // Fails if fewer than `height` rows were written
+    bool close(std::string& error);
+
+private:
+    // Deflates the whole blocks in `pending`, or everything left when `last`
+    bool deflatePending(bool last, std::string& error);
+    // Adds to the compressed data, which goes out in IDAT chunks of a fixed size
+    void writeData(std::span<const uint8_t> data);
+    void writeChunk(const char* type, std::span<const uint8_t> data);
+
+    std::ofstream out;
+    std::string path;
+    bool started = false;
+    int level = 6;
+    int32_t width = 0, height = 0, rows = 0;
+    // Samples of the last row for the Up filter, and the tail of the data already deflated for priming the next block
+    std::vector<uint8_t> previous, window;
+    // Filtered rows not deflated yet, and compressed data not written yet
+    std::vector<uint8_t> pending, buffer;
+    uLong adler = 1;
+};
@@ -0,0 +1,196 @@
+#include "qoi.h"
+#include <algorithm>
+#include <array>
+#include <fstream>
+#include <iterator>
+
+namespace
+{
+    constexpr uint8_t op_index = 0x00, op_diff = 0x40, op_luma = 0x80, op_run = 0xc0, op_rgb = 0xfe, op_rgba = 0xff, op_mask = 0xc0;
+    constexpr size_t header_size = 14;
+    constexpr std::array<uint8_t, 8> end_marker = {0, 0, 0, 0, 0, 0, 0, 1};
+
+    // Slot of a color in the table of recently seen ones
+    uint8_t hash(color_t c)
+    {
+        return static_cast<uint8_t>((c.x * 3 + c.y * 5 + c.z * 7 + c.w * 11) % 64);
+    }
+
+    void putBigEndian(uint8_t* p, uint32_t v)
+    {
+        p[0] = static_cast<uint8_t>(v >> 24);
+        p[1] = static_cast<uint8_t>(v >> 16);
+        p[2] = static_cast<uint8_t>(v >> 8);
+        p[3] = static_cast<uint8_t>(v);
+    }
+
+    uint32_t getBigEndian(const uint8_t* p)
+    {
+        return uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 8 | p[3];
+    }
+} // namespace
+
+bool saveQOI(std::span<const color_t> pixels, int32_t width, int32_t height, const std::string& path, std::string& error)
+{
+    if (width <= 0 || height <= 0 || pixels.size() != static_cast<size_t>(width) * height)
+    {
+        error = "image size does not match its pixels";
+        return false;
+    }
+    // The worst case is four bytes a pixel, encoding straight into a buffer that large needs no bounds checks
+    std::vector<uint8_t> out(header_size + 4 * pixels.size() + end_marker.size());
+    uint8_t* p = out.data();
+    *p++ = 'q';
+    *p++ = 'o';
+    *p++ = 'i';
+    *p++ = 'f';
+    putBigEndian(p, static_cast<uint32_t>(width));
+    putBigEndian(p + 4, static_cast<uint32_t>(height));
+    p += 8;
+    *p++ = 3; // RGB
+    *p++ = 0; // sRGB
+
+    std::array<color_t, 64> seen{};
+    color_t previous(0, 0, 0, 255);
+    int32_t run = 0;
+    for (size_t i = 0; i < pixels.size(); i++)
+    {
+        color_t c(pixels[i].x, pixels[i].y, pixels[i].z, 255);
+        if (c == previous)
+        {
+            if (++run == 62 || i + 1 == pixels.size())
+            {
+                *p++ = static_cast<uint8_t>(op_run | (run - 1));
+                run = 0;
+            }
+            continue;
+        }
+        if (run > 0)
+        {
+            *p++ = static_cast<uint8_t>(op_run | (run - 1));
+            run = 0;
+        }
+        uint8_t slot = hash(c);
+        if (seen[slot] == c)
+        {
+            *p++ = static_cast<uint8_t>(op_index | slot);
+        }
+        else
+        {
+            seen[slot] = c;
+            // Differences wrap around like the bytes they are added to
+            int8_t dr = static_cast<int8_t>(c.x - previous.x), dg = static_cast<int8_t>(c.y - previous.y), db = static_cast<int8_t>(c.z - previous.z);
+            int8_t dr_dg = static_cast<int8_t>(dr - dg), db_dg = static_cast<int8_t>(db - dg);
+            if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1)
+            {
+                *p++ = static_cast<uint8_t>(op_diff | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+            }
+            else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 && db_dg >= -8 && db_dg <= 7)
+            {
+                *p++ = static_cast<uint8_t>(op_luma | (dg + 32));
+                *p++ = static_cast<uint8_t>((dr_dg + 8) << 4 | (db_dg + 8));
+            }
+            else
+            {
+                *p++ = op_rgb;
+                *p++ = c.x;
+                *p++ = c.y;
+                *p++ = c.z;
+            }
+        }
+        previous = c;
+    }
+    for (uint8_t b : end_marker)
+    {
+        *p++ = b;
+    }
+
+    std::ofstream file(path, std::ios::binary);
+    file.write(reinterpret_cast<const char*>(out.data()), p - out.data());
+    if (!file)
+    {
+        error = "cannot write " + path;
+        return false;
+    }
+    return true;
+}
+
+bool loadQOI(const std::string& path, std::vector<color_t>& pixels, int32_t& width, int32_t& height, std::string& error)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+    {
+        error = "cannot read " + path;
+        return false;
+    }
+    std::vector<uint8_t> in{std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+    if (in.size() < header_size + end_marker.size() || in[0] != 'q' || in[1] != 'o' || in[2] != 'i' || in[3] != 'f')
+    {
+        error = path + " is not a QOI image";
+        return false;
+    }
+    uint32_t w = getBigEndian(&in[4]), h = getBigEndian(&in[8]);
+    if (w == 0 || h == 0 || w > (1u << 16) || h > (1u << 16))
+    {
+        error = path + " has an unsupported size";
+        return false;
+    }
+    width = static_cast<int32_t>(w);
+    height = static_cast<int32_t>(h);
+    pixels.resize(static_cast<size_t>(w) * h);
+
+    std::array<color_t, 64> seen{};
+    color_t c(0, 0, 0, 255);
+    size_t p = header_size, end = in.size() - end_marker.size();
+    for (size_t i = 0; i < pixels.size(); i++)
+    {
+        if (p >= end)
+        {
+            error = path + " is cut short";
+            return false;
+        }
+        uint8_t b = in[p++];
+        if (b == op_rgb || b == op_rgba)
+        {
+            size_t n = b == op_rgb ? 3 : 4;
+            if (p + n > end)
+            {
+                error = path + " is cut short";
+                return false;
+            }
+            c.x = in[p];
+            c.y = in[p + 1];
+            c.z = in[p + 2];
+            c.w = b == op_rgba ? in[p + 3] : c.w;
+            p += n;
+        }
+        else if ((b & op_mask) == op_index)
+        {
+            c = seen[b];
+        }
+        else if ((b & op_mask) == op_diff)
+        {
+            c.x = static_cast<uint8_t>(c.x + ((b >> 4) & 3) - 2);
+            c.y = static_cast<uint8_t>(c.y + ((b >> 2) & 3) - 2);
+            c.z = static_cast<uint8_t>(c.z + (b & 3) - 2);
+        }
+        else if ((b & op_mask) == op_luma)
+        {
+            int32_t dg = (b & 0x3f) - 32, next = in[p++];
+            c.x = static_cast<uint8_t>(c.x + dg - 8 + (next >> 4));
+            c.y = static_cast<uint8_t>(c.y + dg);
+            c.z = static_cast<uint8_t>(c.z + dg - 8 + (next & 0x0f));
+        }
+        else
+        {
+            // A run repeats the previous color, which is already in the table
+            size_t count = std::min(static_cast<size_t>(b & 0x3f) + 1, pixels.size() - i);
+            std::fill_n(pixels.begin() + i, count, c);
+            i += count - 1;
+            continue;
+        }
+        seen[hash(c)] = c;
+        pixels[i] = c;
+    }
+    return true;
+}
@@ -0,0 +1,13 @@
+#pragma once
+#include "color.h"
+#include <cstdint>
+#include <span>
+#include <string>
+#include <vector>
+
+// QOI images (qoiformat.org), lossless like PNG but encoded in a single pass without entropy coding, fast
+// enough to dump every frame as it is rendered. Written as RGB, alpha is dropped as it is for PNG.
+bool saveQOI(std::span<const color_t> pixels, int32_t width, int32_t height, const std::string& path, std::string& error);
+
+// Reads RGB and RGBA QOI files into width * height colors row by row
+bool loadQOI(const std::string& path, std::vector<color_t>& pixels, int32_t& width, int32_t& height, std::string& error);
@@ -0,0 +1,234 @@
+#include "quadtree.h"
+#include <algorithm>
+#include <cmath>
+
+void quadtree_t::build(const charges_t& charges)
+{
+    nodes.clear();
+    x.assign(charges.x.begin(), charges.x.end());
+    y.assign(charges.y.begin(), charges.y.end());
+    strength.assign(charges.strength.begin(), charges.strength.end());
+    leaf_of.assign(charges.size(), -1);
+    version = charges.version;
+    last_sync_moves = -1;
+
+    vec2_t lo(0.0f), hi(0.0f);
+    if (!charges.empty())
+    {
+        lo = hi = charges.pos(0);
+    }
+    for (size_t i = 0; i < charges.size(); i++)
+    {
+        lo = glm::min(lo, charges.pos(i));
+        hi = glm::max(hi, charges.pos(i));
+    }
+    // Pad the root so dragging a charge a little past the edge stays incremental
+    float half = 0.75f * std::max(hi.x - lo.x, hi.y - lo.y) + 1.0f;
+    nodes.push_back({.center = 0.5f * (lo + hi), .half = half, .depth = 0, .parent = -1});
+    for (uint32_t i = 0; i < charges.size(); i++)
+    {
+        insert(i);
+    }
+}
+
+void quadtree_t::sync(const charges_t& charges)
+{
+    if (charges.version == version && !nodes.empty())
+    {
+        return;
+    }
+    if (nodes.empty() || charges.size() != strength.size())
+    {
+        build(charges);
+        return;
+    }
+    std::vector<uint32_t> changed;
+    for (uint32_t i = 0; i < charges.size(); i++)
+    {
+        if (charges.x[i] != x[i] || charges.y[i] != y[i] || charges.strength[i] != strength[i])
+        {
+            changed.push_back(i);
+        }
+    }
+    // Past a few percent of the set a fresh build is cheaper than walking every path twice
+    if (changed.size() > 16 + charges.size() / 32)
+    {
+        build(charges);
+        return;
+    }
+    for (uint32_t i : changed)
+    {
+        if (!contains(nodes[0], charges.pos(i)))
+        {
+            build(charges);
+            return;
+        }
+    }
+    for (uint32_t i : changed)
+    {
+        remove(i);
+        x[i] = charges.x[i];
+        y[i] = charges.y[i];
+        strength[i] = charges.strength[i];
+        insert(i);
+    }
+    version = charges.version;
+    last_sync_moves = static_cast<int64_t>(changed.size());
+}
+
+vec2_t quadtree_t::forceAt(vec2_t p, float theta) const
+{
+    double out[3];
+    return evaluate(p, theta, out) ? k * vec2_t(out[0], out[1]) : vec2_t(0.0f);
+}
+
+float quadtree_t::potentialAt(vec2_t p, float theta) const
+{
+    double out[3];
+    return evaluate(p, theta, out) ? static_cast<float>(k * out[2]) : 0.0f;
+}
+
+bool quadtree_t::evaluate(vec2_t p, float theta, double out[3]) const
+{
+    out[0] = out[1] = out[2] = 0;
+    if (nodes.empty())
+    {
+        return true;
+    }
+    float theta2 = theta * theta;
+    int32_t stack[4 * max_depth + 4];
+    int32_t top = 0;
+    stack[top++] = 0;
+    while (top > 0)
+    {
+        const node_t& n = nodes[stack[--top]];
+        if (n.weight == 0)
+        {
+            continue;
+        }
+        if (n.children < 0)
+        {
+            for (uint32_t i : n.indices)
+            {
+                float dx = p.x - x[i], dy = p.y - y[i];
+                float r2 = dx * dx + dy * dy;
+                if (r2 == 0.0f)
+                {
+                    return false;
+                }
+                float inv = 1.0f / std::sqrt(r2);
+                float s = strength[i] * inv * inv * inv;
+                out[0] += s * dx;
+                out[1] += s * dy;
+                out[2] += strength[i] * inv;
+            }
+            continue;
+        }
+        double cx = n.wx / n.weight, cy = n.wy / n.weight;
+        double dx = p.x - cx, dy = p.y - cy;
+        double r2 = dx * dx + dy * dy;
+        double size = 2.0 * n.half;
+        if (contains(n, p) || size * size >= theta2 * r2)
+        {
+            for (int32_t c = 0; c < 4; c++)
+            {
+                stack[top++] = n.children + c;
+            }
+            continue;
+        }
+        // Monopole plus dipole about the |q| weighted centroid
+        double px = n.qx - n.strength * cx, py = n.qy - n.strength * cy;
+        double inv = 1.0 / std::sqrt(r2);
+        double inv3 = inv * inv * inv;
+        double pdotr = px * dx + py * dy;
+        double pr = 3.0 * pdotr * inv * inv;
+        out[0] += inv3 * (n.strength * dx + pr * dx - px);
+        out[1] += inv3 * (n.strength * dy + pr * dy - py);
+        out[2] += n.strength * inv + pdotr * inv3;
+    }
+    return true;
+}
+
+void quadtree_t::addMoments(node_t& n, uint32_t i, double sign)
+{
+    double q = strength[i], w = std::abs(q);
+    n.weight += sign * w;
+    n.strength += sign * q;
+    n.wx += sign * w * x[i];
+    n.wy += sign * w * y[i];
+    n.qx += sign * q * x[i];
+    n.qy += sign * q * y[i];
+}
+
+void quadtree_t::insert(uint32_t i)
+{
+    vec2_t p(x[i], y[i]);
+    int32_t n = 0;
+    while (true)
+    {
+        addMoments(nodes[n], i, 1.0);
+        if (nodes[n].children < 0)
+        {
+            break;
+        }
+        n = nodes[n].children + (p.x >= nodes[n].center.x) + 2 * (p.y >= nodes[n].center.y);
+    }
+    nodes[n].indices.push_back(i);
+    leaf_of[i] = n;
+    if (nodes[n].indices.size() > leaf_capacity && nodes[n].depth < max_depth)
+    {
+        split(n);
+    }
+}
+
+void quadtree_t::remove(uint32_t i)
+{
+    int32_t n = leaf_of[i];
+    auto& indices = nodes[n].indices;
+    *std::ranges::find(indices, i) = indices.back();
+    indices.pop_back();
+    if (indices.empty())
+    {
+        // Drop the rounding residue so an empty leaf is skipped outright
+        nodes[n] = {.center = nodes[n].center, .half = nodes[n].half, .depth = nodes[n].depth, .parent = nodes[n].parent};
+        n = nodes[n].parent;
+    }
+    for (; n >= 0; n = nodes[n].parent)
+    {
+        addMoments(nodes[n], i, -1.0);
+    }
+    leaf_of[i] = -1;
+}
+
+void quadtree_t::split(int32_t n)
+{
+    int32_t first = static_cast<int32_t>(nodes.size());
+    float half = nodes[n].half / 2;
+    for (int32_t c = 0; c < 4; c++)
+    {
+        vec2_t offset((c & 1) ? half : -half, (c & 2) ? half : -half);
+        nodes.push_back({.center = nodes[n].center + offset, .half = half, .depth = nodes[n].depth + 1, .parent = n});
+    }
+    nodes[n].children = first;
+    std::vector<uint32_t> indices = std::move(nodes[n].indices);
+    nodes[n].indices.clear();
+    for (uint32_t i : indices)
+    {
+        int32_t c = first + (x[i] >= nodes[n].center.x) + 2 * (y[i] >= nodes[n].center.y);
+        addMoments(nodes[c], i, 1.0);
+        nodes[c].indices.push_back(i);
+        leaf_of[i] = c;
+    }
+    for (int32_t c = first; c < first + 4; c++)
+    {
+        if (nodes[c].indices.size() > leaf_capacity && nodes[c].depth < max_depth)
+        {
+            split(c);
+        }
+    }
+}
+
+bool quadtree_t::contains(const node_t& n, vec2_t p) const
+{
+    return std::abs(p.x - n.center.x) <= n.half && std::abs(p.y - n.center.y) <= n.half;
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include "field.h"
+#include <cstdint>
+#include <vector>
+
+// Barnes-Hut tree over a charge set. Every node keeps additive moment sums so a
+// single charge can be moved by walking its old and new leaf paths instead of
+// rebuilding the whole tree.
+class quadtree_t
+{
+public:
+    static constexpr size_t leaf_capacity = 16;
+    static constexpr int32_t max_depth = 24;
+
+    void build(const charges_t& charges);
+    // Brings the tree up to date with `charges`, moving only the charges that changed
+    // when there are few of them and rebuilding otherwise
+    void sync(const charges_t& charges);
+
+    // Field at p, far nodes are replaced by their monopole + dipole once size / distance < theta
+    vec2_t forceAt(vec2_t p, float theta) const;
+    float potentialAt(vec2_t p, float theta) const;
+
+    size_t nodeCount() const { return nodes.size(); }
+    // Number of charges moved incrementally by the last sync, or -1 if it rebuilt
+    int64_t lastSyncMoves() const { return last_sync_moves; }
+
+private:
+    struct node_t
+    {
+        vec2_t center;
+        float half;
+        int32_t depth;
+        int32_t parent;
+        int32_t children = -1; // index of the first of 4 consecutive children, -1 for leaves
+        std::vector<uint32_t> indices{};
+        // sum |q|, sum q, sum |q| r, sum q r
+        double weight = 0, strength = 0, wx = 0, wy = 0, qx = 0, qy = 0;
+    };
+
+    std::vector<node_t> nodes;
+    std::vector<int32_t> leaf_of;
+    std::vector<float> x, y, strength; // copy of the charges the tree currently describes
+    uint64_t version = ~uint64_t(0);
+    int64_t last_sync_moves = -1;
+
+    // Accumulates the field (out[0], out[1]) and potential (out[2]) without k, false if p is on a charge
+    bool evaluate(vec2_t p, float theta, double out[3]) const;
+    void addMoments(node_t& n, uint32_t i, double sign);
+    void insert(uint32_t i);
+    void remove(uint32_t i);
+    void split(int32_t n);
+    bool contains(const node_t& n, vec2_t p) const;
+};
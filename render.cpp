@@ -0,0 +1,555 @@
+#include "render.h"
+#include "parallel.h"
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <numbers>
+#include <ranges>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define GAUSS_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace
+{
+    constexpr float FLOAT_EPSILON = 0.05f;
+
+    // Adds the time between construction and destruction to one stage of the frame
+    class stage_timer_t
+    {
+    public:
+        stage_timer_t(render_stats_t& stats, stage_t stage) : ms(stats.stage_milliseconds[static_cast<size_t>(stage)]) {}
+        ~stage_timer_t() { ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count(); }
+
+    private:
+        double& ms;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    };
+
+    // Whether p is closer to another charge than to the one at `own`
+    bool closerToOther(const charges_t& charges, vec2_t own, vec2_t p)
+    {
+        float d2 = glm::dot(p - own, p - own);
+        for (size_t j = 0; j < charges.size(); j++)
+        {
+            vec2_t r = p - charges.pos(j);
+            if (charges.pos(j) != own && glm::dot(r, r) < d2)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Traces line i of charge ci, empty if it would leave along the axis towards a like charge
+    field_line_t traceLine(const solver_t& solver, const charges_t& charges, const render_settings_t& settings, size_t ci, int32_t i)
+    {
+        field_line_t line;
+        charge_t c = charges[ci];
+        float theta = i * (2 * std::numbers::pi) / settings.num_lines;
+        vec2_t p = c.pos + settings.line_dist * vec2_t(std::cos(theta), std::sin(theta));
+        if (std::ranges::any_of(
+                std::views::iota(size_t(0), charges.size()),
+                [&](size_t j)
+                {
+                    charge_t c2 = charges[j];
+                    if ((c.pos != c2.pos) && ((c.strength < 0 && c2.strength < 0) || (c.strength > 0 && c2.strength > 0)))
+                    {
+                        vec2_t v1 = glm::normalize(p - c.pos), v2 = glm::normalize(c2.pos - c.pos);
+                        return std::abs(v1.x - v2.x) < FLOAT_EPSILON && std::abs(v1.y - v2.y) < FLOAT_EPSILON;
+                    }
+                    return false;
+                }))
+        {
+            return line;
+        }
+        trace_settings_t trace = settings.trace;
+        float scale = static_cast<float>(settings.coarse) / settings.zoom;
+        trace.step *= scale;
+        trace.tolerance *= scale;
+        trace.min_step *= scale;
+        trace.max_step *= scale;
+        trace.max_length = static_cast<float>(settings.tmax);
+        trace.lo = settings.lo();
+        trace.hi = settings.hi();
+        line.source = c.pos;
+        line.sign = c.strength > 0 ? 1.0f : -1.0f;
+        line.points = traceFieldLine(solver, p, line.sign, trace, line.evaluations);
+        return line;
+    }
+
+    // Whether a layer drawn from `drawn` is out of date: the charges, the solver or the frame changed,
+    // or one of the settings named by `members` did
+    template <typename stamp_t, typename... members_t>
+    bool stale(const std::optional<stamp_t>& drawn, const stamp_t& now, members_t... members)
+    {
+        if (!drawn || drawn->version != now.version || drawn->source != now.source)
+        {
+            return true;
+        }
+        const render_settings_t &a = drawn->settings, &b = now.settings;
+        return a.width != b.width || a.height != b.height || a.origin != b.origin || a.zoom != b.zoom || a.coarse != b.coarse ||
+               ((a.*members != b.*members) || ...);
+    }
+
+    // Pixels where the mask is not 0 take the color it indexes, mask value 1 being palette[0]
+    void blendOverlay(color_t* pixels, const uint8_t* mask, size_t count, std::span<const color_t> palette)
+    {
+        size_t i = 0;
+#ifdef GAUSS_SSE2
+        // 16 pixels at a time. Line art covers few pixels, so most blocks are skipped after one compare.
+        const __m128i zero = _mm_setzero_si128();
+        for (; i + 16 <= count; i += 16)
+        {
+            __m128i m = _mm_loadu_si128(reinterpret_cast<const __m128i*>(mask + i));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(m, zero)) == 0xFFFF)
+            {
+                continue;
+            }
+            for (size_t c = 0; c < palette.size(); c++)
+            {
+                __m128i hit = _mm_cmpeq_epi8(m, _mm_set1_epi8(static_cast<char>(c + 1)));
+                if (!_mm_movemask_epi8(hit))
+                {
+                    continue;
+                }
+                // Each mask byte widened to the four bytes of its pixel
+                __m128i lo = _mm_unpacklo_epi8(hit, hit), hi = _mm_unpackhi_epi8(hit, hit);
+                const __m128i select[4] = {_mm_unpacklo_epi16(lo, lo), _mm_unpackhi_epi16(lo, lo), _mm_unpacklo_epi16(hi, hi), _mm_unpackhi_epi16(hi, hi)};
+                __m128i color = _mm_set1_epi32(std::bit_cast<int32_t>(palette[c]));
+                for (size_t k = 0; k < 4; k++)
+                {
+                    __m128i* p = reinterpret_cast<__m128i*>(pixels + i + 4 * k);
+                    _mm_storeu_si128(p, _mm_or_si128(_mm_and_si128(select[k], color), _mm_andnot_si128(select[k], _mm_loadu_si128(p))));
+                }
+            }
+        }
+#endif
+        for (; i < count; i++)
+        {
+            if (mask[i])
+            {
+                pixels[i] = palette[mask[i] - 1];
+            }
+        }
+    }
+} // namespace
+
+template <typename pixel_t>
+void basic_canvas_t<pixel_t>::plotPixel(vec2_t q, pixel_t color) const
+{
+    if (q.y >= y0 && q.y < y0 + height && q.x >= x0 && q.x < x0 + width)
+    {
+        pixels[(static_cast<size_t>(q.y) - y0) * width + (static_cast<size_t>(q.x) - x0)] = color;
+    }
+}
+
+template <typename pixel_t>
+void basic_canvas_t<pixel_t>::drawLine(vec2_t a, vec2_t b, pixel_t color) const
+{
+    vec2_t qa = toPixel(a), qb = toPixel(b);
+    if (qb.x < qa.x || (qb.x == qa.x && qb.y < qa.y))
+    {
+        std::swap(qa, qb);
+    }
+    vec2_t d = qb - qa;
+    int32_t steps = std::max(1, static_cast<int32_t>(std::ceil(std::max(std::abs(d.x), std::abs(d.y)))));
+    for (int32_t s = 0; s <= steps; s++)
+    {
+        plotPixel(qa + (static_cast<float>(s) / steps) * d, color);
+    }
+}
+
+template <typename pixel_t>
+void basic_canvas_t<pixel_t>::drawArrow(vec2_t p, vec2_t tangent, pixel_t color) const
+{
+    float phi = 5.0f * static_cast<float>(std::numbers::pi) / 4.0f;
+    float s = std::sin(phi);
+    float c = std::cos(phi);
+    glm::mat<2, 2, float> m{c, -s, s, c};  // rotation matrix
+    glm::mat<2, 2, float> m2{c, s, -s, c}; // rotation matrix
+    vec2_t q = toPixel(p);
+    for (int t = 0; t < settings.head_thickness; t++)
+    {
+        for (int l = 0; l < settings.head_length; l++)
+        {
+            plotPixel(q + static_cast<float>(l) * m * tangent + static_cast<float>(t) * tangent, color);
+            plotPixel(q + static_cast<float>(l) * m2 * tangent + static_cast<float>(t) * tangent, color);
+        }
+    }
+}
+
+template <typename pixel_t>
+void basic_canvas_t<pixel_t>::drawCharge(charge_t c, pixel_t positive, pixel_t negative) const
+{
+    const std::array<glm::ivec2, 9> kernel = {{{0, 0}, {1, 0}, {1, 1}, {0, 1}, {-1, 1}, {-1, 0}, {-1, -1}, {0, -1}, {1, -1}}};
+    for (glm::ivec2 p : kernel)
+    {
+        plotPixel(toPixel(c.pos) + vec2_t(p), c.strength > 0 ? positive : negative);
+    }
+}
+
+template struct basic_canvas_t<color_t>;
+template struct basic_canvas_t<uint8_t>;
+
+void prepareSolver(solver_t& solver, const charges_t& charges, const render_settings_t& settings)
+{
+    solver.method = settings.method;
+    solver.theta = settings.theta;
+    solver.fmm.order = settings.fmm_order;
+    solver.use_grid = settings.use_grid;
+    solver.grid_spacing = settings.grid_spacing / settings.zoom;
+    solver.interpolation = settings.interpolation;
+    solver.view_lo = settings.lo();
+    solver.view_hi = settings.hi();
+    solver.prepare(charges);
+}
+
+std::vector<field_line_t> traceFieldLines(const solver_t& solver, const charges_t& charges, const render_settings_t& settings)
+{
+    // Every line has its own slot, so the order does not depend on how the work was stolen
+    size_t per_charge = static_cast<size_t>(std::max(0, settings.num_lines));
+    std::vector<field_line_t> lines(charges.size() * per_charge);
+    parallelFor(lines.size(),
+                [&](size_t begin, size_t end)
+                {
+                    for (size_t l = begin; l < end; l++)
+                    {
+                        lines[l] = traceLine(solver, charges, settings, l / per_charge, static_cast<int32_t>(l % per_charge) + 1);
+                    }
+                });
+    return lines;
+}
+
+void clipFieldLines(std::span<field_line_t> lines, const charges_t& charges)
+{
+    parallelFor(lines.size(),
+                [&](size_t begin, size_t end)
+                {
+                    for (field_line_t& line : lines.subspan(begin, end - begin))
+                    {
+                        line.visible.assign(line.points.size(), true);
+                        for (size_t j = 1; j < line.points.size(); j++)
+                        {
+                            line.visible[j - 1] = !closerToOther(charges, line.source, line.points[j]);
+                        }
+                    }
+                });
+}
+
+bool arrowOf(const field_line_t& line, const render_settings_t& settings, vec2_t& pos, vec2_t& dir)
+{
+    float arc = 0;
+    for (size_t j = 1; j < line.points.size(); j++)
+    {
+        vec2_t a = line.points[j - 1], b = line.points[j];
+        float length = glm::distance(a, b);
+        arc += length;
+        if (settings.symmetry && !line.visible[j - 1])
+        {
+            continue;
+        }
+        if (arc >= settings.arrow_distance && length > 0)
+        {
+            // Exactly arrow_distance along the line, pointing along the field
+            pos = b - ((arc - settings.arrow_distance) / length) * (b - a);
+            dir = line.sign * (b - a) / length;
+            return true;
+        }
+    }
+    return false;
+}
+
+std::array<vec2_t, 3> arrowHead(vec2_t tip, vec2_t dir, float length, float thickness)
+{
+    // The wings of drawArrow, rotated 135 degrees either way from the direction
+    float phi = 5.0f * static_cast<float>(std::numbers::pi) / 4.0f;
+    float s = std::sin(phi);
+    float c = std::cos(phi);
+    glm::mat<2, 2, float> m{c, -s, s, c};
+    glm::mat<2, 2, float> m2{c, s, -s, c};
+    return {tip + thickness * dir, tip + length * (m * dir), tip + length * (m2 * dir)};
+}
+
+const std::vector<field_line_t>& field_lines_t::update(const solver_t& solver, const charges_t& charges, const render_settings_t& settings)
+{
+    key_t key{charges.version,     solver.settingsKey(),  settings.trace,    settings.num_lines,     settings.tmax,
+              settings.line_dist, settings.zoom,         settings.grid_spacing, settings.use_grid, settings.interpolation,
+              settings.lo(),      settings.hi()};
+    last_traced = key != built;
+    if (last_traced)
+    {
+        lines = traceFieldLines(solver, charges, settings);
+        built = key;
+        clipped = false;
+    }
+    // The clip is only worked out once it is first asked for, it costs a pass over every charge per point
+    if (settings.symmetry && !clipped)
+    {
+        clipFieldLines(lines, charges);
+        clipped = true;
+    }
+    return lines;
+}
+
+std::vector<float> equipotentialLevels(const solver_t& solver, const charges_t& charges, const render_settings_t& settings)
+{
+    // The potential at k * equipotential_dist from each charge
+    std::vector<float> levels;
+    for (size_t i = 0; i < charges.size(); i++)
+    {
+        for (int k = 1; k <= settings.ring_count; k++)
+        {
+            levels.push_back(solver.potentialAt(charges.pos(i) + vec2_t(static_cast<float>(k) * settings.equipotential_dist, 0.0f)));
+        }
+    }
+    std::ranges::sort(levels);
+    auto duplicates = std::ranges::unique(levels, [](float a, float b) { return std::abs(a - b) <= 1e-4f * std::max(std::abs(a), std::abs(b)); });
+    levels.erase(duplicates.begin(), duplicates.end());
+    return levels;
+}
+
+bool renderer_t::render(const charges_t& charges, const render_settings_t& settings, std::span<color_t> pixels, const std::atomic<bool>* cancel)
+{
+    using s_t = render_settings_t;
+    auto start = std::chrono::steady_clock::now();
+    uint64_t evaluations = solver.evaluationCount();
+    render_stats_t stats;
+    line_layer.clear();
+    auto cancelled = [cancel] { return cancel && cancel->load(std::memory_order_relaxed); };
+
+    {
+        stage_timer_t timer(stats, stage_t::prepare);
+        prepareSolver(solver, charges, settings);
+    }
+    if (cancelled())
+    {
+        return false;
+    }
+    level_t& level = cached[settings.coarse];
+    const stamp_t now{settings, charges.version, solver.settingsKey()};
+    // Clears an overlay for drawing. Stale overlays are only marked empty, in case they stay that way.
+    auto clearOverlay = [&](overlay_t& overlay)
+    {
+        overlay.mask.assign(pixels.size(), 0);
+        overlay.empty = false;
+        return basic_canvas_t<uint8_t>{overlay.mask, settings};
+    };
+
+    if (stale(level.background_drawn, now, &s_t::fieldcolor, &s_t::heat_quantity, &s_t::heat_scale, &s_t::colormap))
+    {
+        stage_timer_t timer(stats, stage_t::background);
+        std::vector<color_t>& background = level.background;
+        background.resize(pixels.size());
+        if (settings.fieldcolor)
+        {
+            heatmap.quantity = settings.heat_quantity;
+            heatmap.scale = settings.heat_scale;
+            heatmap.colormap = settings.colormap;
+            if (settings.coarse > 1)
+            {
+                // One sample at the center of every coarse x coarse block, copied over the block
+                int32_t c = settings.coarse, width = (settings.width + c - 1) / c, height = (settings.height + c - 1) / c;
+                coarse_pixels.resize(static_cast<size_t>(width) * height);
+                heatmap.render(solver, coarse_pixels, width, height, settings.origin, c / settings.zoom);
+                parallelFor(settings.height,
+                            [&](size_t begin, size_t end)
+                            {
+                                for (size_t y = begin; y < end; y++)
+                                {
+                                    for (int32_t x = 0; x < settings.width; x++)
+                                    {
+                                        background[y * settings.width + x] = coarse_pixels[(y / c) * width + x / c];
+                                    }
+                                }
+                            });
+            }
+            else
+            {
+                heatmap.render(solver, background, settings.width, settings.height, settings.origin, 1.0f / settings.zoom);
+            }
+        }
+        else
+        {
+            parallelFor(
+                background.size(), [&](size_t begin, size_t end) { std::fill(background.begin() + begin, background.begin() + end, colors::white); },
+                1 << 16);
+        }
+        level.background_drawn = now;
+    }
+    if (cancelled())
+    {
+        return false;
+    }
+
+    overlay_t& equipotential_mask = level.overlays[equipotential_overlay];
+    bool equipotentials_stale = stale(equipotential_mask.drawn, now, &s_t::equipotential, &s_t::vector_lines, &s_t::equipotential_dist, &s_t::ring_count,
+                                      &s_t::equipotential_spacing);
+    equipotential_mask.empty = equipotential_mask.empty || equipotentials_stale;
+    if (settings.equipotential && (equipotentials_stale || settings.vector_lines))
+    {
+        stage_timer_t timer(stats, stage_t::equipotentials);
+        std::vector<float> levels = equipotentialLevels(solver, charges, settings);
+        equipotentials_t& equipotentials = level.equipotentials;
+        equipotentials.spacing = settings.coarse * settings.equipotential_spacing / settings.zoom;
+        const std::vector<polyline_t>& lines = equipotentials.extract(solver, charges.version, settings.lo(), settings.hi(), levels);
+        if (settings.vector_lines)
+        {
+            line_layer.equipotentials = lines;
+        }
+        else
+        {
+            basic_canvas_t<uint8_t> canvas = clearOverlay(equipotential_mask);
+            for (const polyline_t& line : lines)
+            {
+                for (size_t j = 1; j < line.size(); j++)
+                {
+                    canvas.drawLine(line[j - 1], line[j], 1);
+                }
+            }
+        }
+    }
+    equipotential_mask.drawn = now;
+    if (cancelled())
+    {
+        return false;
+    }
+
+    // Both depend on everything that shapes the lines, the arrows also on where they go
+    auto traced_stale = [&](const overlay_t& overlay, auto... members)
+    {
+        return stale(overlay.drawn, now, &s_t::fieldlines, &s_t::vector_lines, &s_t::symmetry, &s_t::num_lines, &s_t::line_dist, &s_t::tmax, &s_t::trace,
+                     &s_t::use_grid, &s_t::grid_spacing, &s_t::interpolation, members...);
+    };
+    overlay_t& line_mask = level.overlays[line_overlay];
+    overlay_t& arrow_mask = level.overlays[arrow_overlay];
+    bool lines_stale = traced_stale(line_mask);
+    bool arrows_stale = traced_stale(arrow_mask, &s_t::arrows, &s_t::arrow_distance, &s_t::head_length, &s_t::head_thickness);
+    line_mask.empty = line_mask.empty || lines_stale;
+    arrow_mask.empty = arrow_mask.empty || arrows_stale;
+    if (settings.fieldlines && settings.num_lines > 0 && (lines_stale || (arrows_stale && settings.arrows) || settings.vector_lines))
+    {
+        field_lines_t& field_lines = level.field_lines;
+        // Lines are traced in parallel, kept until their shape changes and drawn in slot order,
+        // so the image does not depend on the number of threads
+        const std::vector<field_line_t>* lines;
+        {
+            stage_timer_t timer(stats, stage_t::trace);
+            lines = &field_lines.update(solver, charges, settings);
+            for (const field_line_t& line : *lines)
+            {
+                stats.field_evaluations += field_lines.traced() ? line.evaluations : 0;
+            }
+        }
+        if (cancelled())
+        {
+            return false;
+        }
+        if (lines_stale || settings.vector_lines)
+        {
+            stage_timer_t timer(stats, stage_t::lines);
+            std::optional<basic_canvas_t<uint8_t>> canvas;
+            if (!settings.vector_lines)
+            {
+                canvas.emplace(clearOverlay(line_mask));
+            }
+            for (const field_line_t& line : *lines)
+            {
+                for (size_t j = 1; j < line.points.size(); j++)
+                {
+                    if (settings.symmetry && !line.visible[j - 1])
+                    {
+                        continue;
+                    }
+                    if (canvas)
+                    {
+                        canvas->drawLine(line.points[j - 1], line.points[j], 1);
+                    }
+                    else if (j == 1 || (settings.symmetry && !line.visible[j - 2]))
+                    {
+                        line_layer.field_lines.push_back({line.points[j - 1], line.points[j]});
+                    }
+                    else
+                    {
+                        line_layer.field_lines.back().push_back(line.points[j]);
+                    }
+                }
+            }
+        }
+        if (settings.arrows && (arrows_stale || settings.vector_lines))
+        {
+            stage_timer_t timer(stats, stage_t::arrows);
+            std::optional<basic_canvas_t<uint8_t>> canvas;
+            if (!settings.vector_lines)
+            {
+                canvas.emplace(clearOverlay(arrow_mask));
+            }
+            for (const field_line_t& line : *lines)
+            {
+                vec2_t pos, dir;
+                if (!arrowOf(line, settings, pos, dir))
+                {
+                    continue;
+                }
+                if (canvas)
+                {
+                    canvas->drawArrow(pos, dir, 1);
+                }
+                else
+                {
+                    line_layer.arrows.push_back({pos, dir});
+                }
+            }
+        }
+    }
+    line_mask.drawn = now;
+    arrow_mask.drawn = now;
+
+    overlay_t& charge_mask = level.overlays[charge_overlay];
+    if (stale(charge_mask.drawn, now))
+    {
+        stage_timer_t timer(stats, stage_t::charges);
+        basic_canvas_t<uint8_t> canvas = clearOverlay(charge_mask);
+        for (size_t i = 0; i < charges.size(); i++)
+        {
+            canvas.drawCharge(charges[i], 1, 2);
+        }
+        charge_mask.drawn = now;
+    }
+    {
+        // The layers in the order they used to be drawn, so later ones cover earlier ones as before
+        stage_timer_t timer(stats, stage_t::composite);
+        const color_t green[] = {colors::green}, line[] = {settings.line_color}, black[] = {colors::black}, charge[] = {colors::red, colors::blue};
+        const std::array<std::span<const color_t>, overlay_count> palettes = {green, line, black, charge};
+        parallelFor(
+            pixels.size(),
+            [&](size_t begin, size_t end)
+            {
+                std::copy(level.background.begin() + begin, level.background.begin() + end, pixels.begin() + begin);
+                for (size_t i = 0; i < overlay_count; i++)
+                {
+                    if (!level.overlays[i].empty)
+                    {
+                        blendOverlay(pixels.data() + begin, level.overlays[i].mask.data() + begin, end - begin, palettes[i]);
+                    }
+                }
+            },
+            1 << 14);
+    }
+
+    stats.force_evaluations = solver.evaluationCount() - evaluations;
+    stats.tree_nodes = solver.tree.nodeCount();
+    stats.tree_moves = solver.tree.lastSyncMoves();
+    stats.fmm_levels = solver.fmm.levels();
+    stats.fmm_milliseconds = solver.fmm.buildMilliseconds();
+    stats.grid_width = solver.grid.width();
+    stats.grid_height = solver.grid.height();
+    stats.grid_milliseconds = solver.grid.buildMilliseconds();
+    stats.milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    last_stats = stats;
+    return true;
+}
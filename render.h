@@ -0,0 +1,244 @@
+#pragma once
+#include "color.h"
+#include "contour.h"
+#include "heatmap.h"
+#include "solver.h"
+#include "tracer.h"
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <span>
+#include <vector>
+
+// Everything that decides what a frame looks like. Pixel (x, y) covers origin + (x, y) / zoom.
+struct render_settings_t
+{
+    int32_t width = 301, height = 301;
+    vec2_t origin = vec2_t(-150.0f);
+    // Pixels per world unit. Step sizes, spacings and arrow heads are in pixels, distances along lines in world units.
+    float zoom = 1.0f;
+
+    bool equipotential = true, fieldlines = true, fieldcolor = false, arrows = true, symmetry = true;
+
+    int32_t num_lines = 16;
+    float line_dist = 2;
+    int32_t tmax = 200;
+    trace_settings_t trace;
+    int32_t arrow_distance = 50;
+    int32_t head_length = 5;
+    int32_t head_thickness = 3;
+    color_t line_color = colors::black;
+
+    int32_t equipotential_dist = 20;
+    int32_t ring_count = 2;
+    float equipotential_spacing = 1.0f;
+
+    heat_quantity_t heat_quantity = heat_quantity_t::magnitude;
+    heat_scale_t heat_scale = heat_scale_t::log;
+    colormap_t colormap = colormap_t::viridis;
+
+    method_t method = method_t::direct;
+    float theta = 0.5f;
+    int32_t fmm_order = 8;
+    bool use_grid = false;
+    float grid_spacing = 1.0f;
+    interpolation_t interpolation = interpolation_t::bilinear;
+
+    // Leave field lines, equipotentials and arrows out of the pixels and hand them over as geometry
+    // instead, for a caller that draws them itself at screen resolution
+    bool vector_lines = false;
+    // Preview quality for progressive rendering, 1 is full quality. The heat map and the equipotential
+    // lattice are sampled every `coarse` pixels and field lines are traced with `coarse` times larger steps.
+    int32_t coarse = 1;
+
+    vec2_t lo() const { return origin; }
+    vec2_t hi() const { return origin + vec2_t(width - 1, height - 1) / zoom; }
+    bool operator==(const render_settings_t&) const = default;
+};
+
+// Draws into a frame laid out as `settings` describes, anything outside it is dropped. Pixels are colors
+// for images and palette indices for the renderer's cached layers.
+template <typename pixel_t>
+struct basic_canvas_t
+{
+    std::span<pixel_t> pixels;
+    const render_settings_t& settings;
+    // Part of the frame `pixels` holds, the whole frame unless it is one tile of a larger image.
+    // Positions are mapped through the whole frame first, so neighbouring tiles line up exactly.
+    int32_t x0 = 0, y0 = 0, width = settings.width, height = settings.height;
+
+    vec2_t toPixel(vec2_t p) const { return (p - settings.origin) * settings.zoom; }
+    void plotPixel(vec2_t q, pixel_t color) const;
+    void plot(vec2_t p, pixel_t color) const { plotPixel(toPixel(p), color); }
+    // Plots every pixel the segment passes through, one step per pixel along its longer axis.
+    // The same pixels either way round, so a segment drawn twice from different tiles matches.
+    void drawLine(vec2_t a, vec2_t b, pixel_t color) const;
+    // Arrow head of head_length by head_thickness pixels at p, pointing along the unit vector tangent
+    void drawArrow(vec2_t p, vec2_t tangent, pixel_t color = colors::black) const;
+    // 3 by 3 pixel marker, red for a positive charge and blue for a negative one
+    void drawCharge(charge_t c, pixel_t positive = colors::red, pixel_t negative = colors::blue) const;
+};
+
+using canvas_t = basic_canvas_t<color_t>;
+
+// A traced field line, the same whatever it is drawn with
+struct field_line_t
+{
+    polyline_t points;
+    vec2_t source;  // the charge it starts from
+    float sign = 1; // 1 if the points run along the field, -1 against it
+    // Per segment, false where it is closer to another charge than to its source. Filled by clipFieldLines.
+    std::vector<bool> visible;
+    size_t evaluations = 0;
+};
+
+// The steps of a frame that do not depend on how it is split into pixels, shared with the tiled export.
+// Points the solver at the view and brings it up to date with the charges.
+void prepareSolver(solver_t& solver, const charges_t& charges, const render_settings_t& settings);
+// num_lines lines per charge, traced in parallel and returned in charge order whatever the thread count
+std::vector<field_line_t> traceFieldLines(const solver_t& solver, const charges_t& charges, const render_settings_t& settings);
+// Fills in `visible` for the symmetry clip
+void clipFieldLines(std::span<field_line_t> lines, const charges_t& charges);
+// Arrow arrow_distance along the line, on a visible segment when clipping. False if the line is shorter.
+bool arrowOf(const field_line_t& line, const render_settings_t& settings, vec2_t& pos, vec2_t& dir);
+// Corners of an arrow head as one filled triangle, for drawing it as a shape rather than pixel by pixel.
+// tip and the result are in pixels, the wings are `length` long like drawArrow's and it is `thickness` deep.
+std::array<vec2_t, 3> arrowHead(vec2_t tip, vec2_t dir, float length, float thickness);
+// One potential per equipotential ring, sorted with near duplicates removed
+std::vector<float> equipotentialLevels(const solver_t& solver, const charges_t& charges, const render_settings_t& settings);
+
+// Field lines kept between frames. Only the settings that shape them cause a re-trace: the charges, the
+// solver, the trace settings and the view. Colors, arrows and the symmetry clip are applied when drawing.
+class field_lines_t
+{
+public:
+    const std::vector<field_line_t>& update(const solver_t& solver, const charges_t& charges, const render_settings_t& settings);
+    // Whether the last update traced the lines instead of reusing them
+    bool traced() const { return last_traced; }
+
+private:
+    struct key_t
+    {
+        uint64_t version, source;
+        trace_settings_t trace;
+        int32_t num_lines, tmax;
+        float line_dist, zoom, grid_spacing;
+        bool use_grid;
+        interpolation_t interpolation;
+        vec2_t lo, hi;
+
+        bool operator==(const key_t&) const = default;
+    };
+
+    std::optional<key_t> built;
+    std::vector<field_line_t> lines;
+    bool clipped = false, last_traced = false;
+};
+
+// The lines of a frame rendered with vector_lines, in world coordinates
+struct line_layer_t
+{
+    std::vector<polyline_t> equipotentials;
+    // Visible runs of the field lines, split where the symmetry clip hides a segment
+    std::vector<polyline_t> field_lines;
+    std::vector<std::array<vec2_t, 2>> arrows; // position and unit direction
+
+    void clear()
+    {
+        equipotentials.clear();
+        field_lines.clear();
+        arrows.clear();
+    }
+};
+
+// Parts of a frame timed separately, in the order they run
+enum class stage_t
+{
+    prepare,
+    background,
+    equipotentials,
+    trace,
+    lines,
+    arrows,
+    charges,
+    composite,
+    count,
+};
+
+inline const char* stage_names[] = {"Solver update", "Background", "Equipotentials", "Field line tracing", "Line drawing", "Arrows", "Charges", "Compositing"};
+
+struct render_stats_t
+{
+    double milliseconds = 0;
+    std::array<double, static_cast<size_t>(stage_t::count)> stage_milliseconds{};
+    // Direction samples taken by the field line tracer, grid lookups included
+    size_t field_evaluations = 0;
+    // Field and potential evaluations the solver made for this frame
+    uint64_t force_evaluations = 0;
+    size_t tree_nodes = 0;
+    int64_t tree_moves = -1;
+    int32_t fmm_levels = 0;
+    double fmm_milliseconds = 0;
+    int32_t grid_width = 0, grid_height = 0;
+    double grid_milliseconds = 0;
+};
+
+// Draws whole frames. Owns the solver and the caches that carry over between frames of the same charges,
+// so one renderer must not be used from two threads at once. The background and each kind of line art are
+// kept as separate layers and only redrawn when a setting they depend on changes, then composited.
+class renderer_t
+{
+public:
+    solver_t solver;
+
+    // pixels holds settings.width * settings.height colors, row by row from origin.y up. `cancel` is checked
+    // between stages, once it is set the frame is abandoned half drawn and render returns false.
+    bool render(const charges_t& charges, const render_settings_t& settings, std::span<color_t> pixels, const std::atomic<bool>* cancel = nullptr);
+    const render_stats_t& stats() const { return last_stats; }
+    // Lines of the last frame, empty unless it was rendered with vector_lines
+    const line_layer_t& lineLayer() const { return line_layer; }
+
+private:
+    // What a layer was last drawn from. It is redrawn when any of the settings it depends on differs.
+    struct stamp_t
+    {
+        render_settings_t settings;
+        uint64_t version, source;
+    };
+
+    // Lines and markers drawn over the background. Each pixel is 0 where the layer is transparent and
+    // otherwise one plus an index into the colors it is composited with, so recoloring costs no redraw.
+    struct overlay_t
+    {
+        std::vector<uint8_t> mask;
+        std::optional<stamp_t> drawn;
+        bool empty = true;
+    };
+
+    enum overlay_index_t
+    {
+        equipotential_overlay,
+        line_overlay,
+        arrow_overlay,
+        charge_overlay,
+        overlay_count,
+    };
+
+    // Everything kept between frames of one preview level, so previews and full frames do not evict each other
+    struct level_t
+    {
+        equipotentials_t equipotentials;
+        field_lines_t field_lines;
+        std::vector<color_t> background;
+        std::optional<stamp_t> background_drawn;
+        std::array<overlay_t, overlay_count> overlays;
+    };
+
+    heatmap_t heatmap;
+    std::map<int32_t, level_t> cached;
+    std::vector<color_t> coarse_pixels;
+    line_layer_t line_layer;
+    render_stats_t last_stats;
+};
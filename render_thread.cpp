@@ -0,0 +1,105 @@
+#include "render_thread.h"
+#include <utility>
+
+render_thread_t::render_thread_t(std::function<void()> on_frame) : on_frame(std::move(on_frame)), thread([this](std::stop_token stop) { loop(stop); })
+{
+}
+
+render_thread_t::~render_thread_t()
+{
+    thread.request_stop();
+    // After the stop no new frame starts, so the flag stays set for the one in flight
+    std::lock_guard lock(mutex);
+    cancel = true;
+}
+
+void render_thread_t::request(std::shared_ptr<const charges_t> charges, const render_settings_t& settings, bool measure_error, bool progressive)
+{
+    {
+        std::lock_guard lock(mutex);
+        pending = request_t{std::move(charges), settings, measure_error, progressive};
+        cancel = rendering;
+    }
+    wake.notify_one();
+}
+
+bool render_thread_t::fetch(frame_t& frame)
+{
+    std::lock_guard lock(mutex);
+    if (!fresh)
+    {
+        return false;
+    }
+    std::swap(frame, ready);
+    fresh = false;
+    return true;
+}
+
+bool render_thread_t::busy() const
+{
+    std::lock_guard lock(mutex);
+    return rendering || pending;
+}
+
+void render_thread_t::loop(std::stop_token stop)
+{
+    while (true)
+    {
+        request_t job;
+        {
+            std::unique_lock lock(mutex);
+            // Once stop is requested the wait returns whether a request is pending, it is dropped
+            if (!wake.wait(lock, stop, [this] { return pending.has_value(); }) || stop.stop_requested())
+            {
+                return;
+            }
+            job = std::move(*pending);
+            pending.reset();
+            rendering = true;
+            cancel = false;
+        }
+
+        // A preview only pays off on frames big enough to take a while
+        const int32_t preview = 4;
+        bool progressive = job.progressive && job.settings.coarse == 1 && job.settings.width > preview && job.settings.height > preview;
+        for (int32_t coarse : {preview, 1})
+        {
+            if (coarse != 1 && !progressive)
+            {
+                continue;
+            }
+            render_settings_t settings = job.settings;
+            settings.coarse = coarse;
+            back.width = settings.width;
+            back.height = settings.height;
+            back.pixels.resize(static_cast<size_t>(back.width) * back.height);
+            if (!renderer.render(*job.charges, settings, back.pixels, &cancel))
+            {
+                break;
+            }
+            back.settings = job.settings;
+            back.lines = renderer.lineLayer();
+            back.stats = renderer.stats();
+            back.coarse = coarse;
+            back.fmm_error = {};
+            if (coarse == 1 && job.measure_error && job.settings.method == method_t::fmm)
+            {
+                back.fmm_error = renderer.solver.fmm.measureError(*job.charges, 1000);
+            }
+
+            {
+                std::lock_guard lock(mutex);
+                back.serial = ++serial;
+                std::swap(back, ready);
+                fresh = true;
+            }
+            if (on_frame)
+            {
+                on_frame();
+            }
+        }
+
+        std::lock_guard lock(mutex);
+        rendering = false;
+    }
+}
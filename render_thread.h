@@ -0,0 +1,74 @@
+#pragma once
+#include "render.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stop_token>
+#include <thread>
+#include <vector>
+
+struct frame_t
+{
+    std::vector<color_t> pixels;
+    int32_t width = 0, height = 0;
+    // What the frame was rendered with, it may lag behind the current settings
+    render_settings_t settings;
+    line_layer_t lines;
+    render_stats_t stats;
+    // Above 1 for the quick previews of a progressive request, see render_settings_t::coarse
+    int32_t coarse = 1;
+    // Only filled for frames requested with measure_error
+    fmm_t::error_t fmm_error;
+    uint64_t serial = 0;
+};
+
+// Renders on a worker thread into a back buffer so a slow frame never stalls the caller.
+// A new request replaces one that has not started yet, and finished frames wait in a mailbox
+// until fetched, so the caller always gets the newest complete frame and never a partial one.
+// A progressive request first publishes a coarse preview, and a newer request cancels the frame in flight.
+class render_thread_t
+{
+public:
+    // on_frame is called from the worker whenever a frame is ready to fetch, so the caller can sleep until then
+    explicit render_thread_t(std::function<void()> on_frame = {});
+    // Cancels the frame in flight instead of waiting for it to finish
+    ~render_thread_t();
+
+    // Renders `charges`, which must not change while shared, so requests for the same charges share one
+    // copy however often the view changes. measure_error also compares the fmm against the direct sum,
+    // progressive renders a coarse preview before the full frame.
+    void request(std::shared_ptr<const charges_t> charges, const render_settings_t& settings, bool measure_error = false, bool progressive = false);
+    // Swaps the newest finished frame into `frame`, false if none finished since the last fetch
+    bool fetch(frame_t& frame);
+    // Whether a request is queued or being rendered
+    bool busy() const;
+
+private:
+    struct request_t
+    {
+        std::shared_ptr<const charges_t> charges;
+        render_settings_t settings;
+        bool measure_error;
+        bool progressive;
+    };
+
+    renderer_t renderer;
+    mutable std::mutex mutex;
+    std::condition_variable_any wake;
+    std::optional<request_t> pending;
+    bool rendering = false;
+    // Set when a request arrives while rendering, so the worker drops the frame at the next stage
+    std::atomic<bool> cancel = false;
+    frame_t back, ready;
+    bool fresh = false;
+    uint64_t serial = 0;
+    std::function<void()> on_frame;
+    // Declared last so the worker starts after, and is stopped and joined before, everything it uses
+    std::jthread thread;
+
+    void loop(std::stop_token stop);
+};
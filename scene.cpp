@@ -0,0 +1,374 @@
+#include "scene.h"
+#include <bit>
+#include <charconv>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <iterator>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <string_view>
+#include <type_traits>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+    constexpr std::string_view magic = "gauss-scene 1";
+    constexpr size_t block_alignment = 64;
+    // Larger frames than this are taken for a damaged header rather than allocated
+    constexpr int32_t max_frame_size = 1 << 16;
+
+    // A whole file mapped copy-on-write, writes through the mapping never reach the file
+    class mapped_file_t
+    {
+    public:
+        explicit mapped_file_t(const std::string& path)
+        {
+#if defined(_WIN32)
+            HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+            if (file == INVALID_HANDLE_VALUE)
+            {
+                return;
+            }
+            LARGE_INTEGER file_size;
+            if (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0)
+            {
+                HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+                if (mapping)
+                {
+                    data = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+                    size = data ? static_cast<size_t>(file_size.QuadPart) : 0;
+                    CloseHandle(mapping);
+                }
+            }
+            CloseHandle(file);
+#else
+            int fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0)
+            {
+                return;
+            }
+            struct stat info;
+            if (fstat(fd, &info) == 0 && info.st_size > 0)
+            {
+                void* address = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+                if (address != MAP_FAILED)
+                {
+                    data = address;
+                    size = static_cast<size_t>(info.st_size);
+                }
+            }
+            close(fd);
+#endif
+        }
+
+        ~mapped_file_t()
+        {
+            if (!data)
+            {
+                return;
+            }
+#if defined(_WIN32)
+            UnmapViewOfFile(data);
+#else
+            munmap(data, size);
+#endif
+        }
+
+        mapped_file_t(const mapped_file_t&) = delete;
+        mapped_file_t& operator=(const mapped_file_t&) = delete;
+
+        char* bytes() const { return static_cast<char*>(data); }
+        size_t length() const { return size; }
+
+    private:
+        void* data = nullptr;
+        size_t size = 0;
+    };
+
+    // Calls visit(key, member) for every setting stored in the header
+    template <typename settings_t, typename visit_t>
+    void visitSettings(settings_t& s, visit_t&& visit)
+    {
+        visit("width", s.width);
+        visit("height", s.height);
+        visit("origin", s.origin);
+        visit("zoom", s.zoom);
+        visit("equipotential", s.equipotential);
+        visit("fieldlines", s.fieldlines);
+        visit("fieldcolor", s.fieldcolor);
+        visit("arrows", s.arrows);
+        visit("symmetry", s.symmetry);
+        visit("num_lines", s.num_lines);
+        visit("line_dist", s.line_dist);
+        visit("tmax", s.tmax);
+        visit("integrator", s.trace.integrator);
+        visit("step", s.trace.step);
+        visit("tolerance", s.trace.tolerance);
+        visit("min_step", s.trace.min_step);
+        visit("max_step", s.trace.max_step);
+        visit("arrow_distance", s.arrow_distance);
+        visit("head_length", s.head_length);
+        visit("head_thickness", s.head_thickness);
+        visit("line_color", s.line_color);
+        visit("equipotential_dist", s.equipotential_dist);
+        visit("ring_count", s.ring_count);
+        visit("equipotential_spacing", s.equipotential_spacing);
+        visit("heat_quantity", s.heat_quantity);
+        visit("heat_scale", s.heat_scale);
+        visit("colormap", s.colormap);
+        visit("method", s.method);
+        visit("theta", s.theta);
+        visit("fmm_order", s.fmm_order);
+        visit("use_grid", s.use_grid);
+        visit("grid_spacing", s.grid_spacing);
+        visit("interpolation", s.interpolation);
+    }
+
+    template <typename value_t>
+    void writeValue(std::ostream& out, const value_t& value)
+    {
+        if constexpr (std::is_same_v<value_t, vec2_t>)
+        {
+            out << value.x << ' ' << value.y;
+        }
+        else if constexpr (std::is_same_v<value_t, color_t>)
+        {
+            out << int(value.x) << ' ' << int(value.y) << ' ' << int(value.z) << ' ' << int(value.w);
+        }
+        else if constexpr (std::is_enum_v<value_t> || std::is_same_v<value_t, bool>)
+        {
+            out << static_cast<int>(value);
+        }
+        else
+        {
+            out << value;
+        }
+    }
+
+    template <typename value_t>
+    bool readValue(std::istream& in, value_t& value)
+    {
+        if constexpr (std::is_same_v<value_t, vec2_t>)
+        {
+            return static_cast<bool>(in >> value.x >> value.y);
+        }
+        else if constexpr (std::is_same_v<value_t, color_t>)
+        {
+            int r, g, b, a;
+            if (!(in >> r >> g >> b >> a))
+            {
+                return false;
+            }
+            value = color_t(r, g, b, a);
+            return true;
+        }
+        else if constexpr (std::is_enum_v<value_t> || std::is_same_v<value_t, bool>)
+        {
+            int v;
+            if (!(in >> v))
+            {
+                return false;
+            }
+            value = static_cast<value_t>(v);
+            return true;
+        }
+        else
+        {
+            return static_cast<bool>(in >> value);
+        }
+    }
+} // namespace
+
+bool loadScene(const std::string& path, scene_t& scene, std::string& error)
+{
+    auto file = std::make_shared<mapped_file_t>(path);
+    if (!file->bytes())
+    {
+        error = "cannot map " + path;
+        return false;
+    }
+    std::string_view text(file->bytes(), file->length());
+
+    render_settings_t settings;
+    size_t count = 0, block = 0;
+    bool first = true, found = false;
+    while (!found)
+    {
+        size_t end = text.find('\n');
+        if (end == std::string_view::npos)
+        {
+            error = path + " ends before the charges line";
+            return false;
+        }
+        std::string_view line = text.substr(0, end);
+        text.remove_prefix(end + 1);
+        if (first)
+        {
+            if (line != magic)
+            {
+                error = path + " is not a scene file";
+                return false;
+            }
+            first = false;
+            continue;
+        }
+        std::string_view key = line.substr(0, line.find(' '));
+        std::string_view rest = key.size() < line.size() ? line.substr(key.size() + 1) : std::string_view();
+        if (key == "charges")
+        {
+            if (std::from_chars(rest.data(), rest.data() + rest.size(), count).ec != std::errc())
+            {
+                error = path + ": bad charge count";
+                return false;
+            }
+            size_t header = static_cast<size_t>(text.data() - file->bytes());
+            block = (header + block_alignment - 1) / block_alignment * block_alignment;
+            found = true;
+            continue;
+        }
+        std::istringstream values{std::string(rest)};
+        bool ok = true;
+        visitSettings(settings,
+                      [&](std::string_view name, auto& member)
+                      {
+                          if (name == key)
+                          {
+                              ok = readValue(values, member);
+                          }
+                      });
+        if (!ok)
+        {
+            error = path + ": bad value for " + std::string(key);
+            return false;
+        }
+    }
+
+    if (settings.width <= 0 || settings.height <= 0 || settings.width > max_frame_size || settings.height > max_frame_size)
+    {
+        error = path + ": bad frame size";
+        return false;
+    }
+    if (!(settings.zoom > 0) || !std::isfinite(settings.zoom) || !std::isfinite(settings.origin.x) || !std::isfinite(settings.origin.y))
+    {
+        error = path + ": bad view";
+        return false;
+    }
+    // Enums index name and lookup tables, and the tracers and lattices step by these, so a damaged file
+    // could read out of bounds or never finish
+    auto known = [](auto value, const auto& names) { return static_cast<size_t>(value) < std::size(names); };
+    if (!known(settings.trace.integrator, integrator_names) || !known(settings.heat_quantity, heat_quantity_names) ||
+        !known(settings.heat_scale, heat_scale_names) || !known(settings.colormap, colormap_names) || !known(settings.method, method_names) ||
+        !known(settings.interpolation, interpolation_names))
+    {
+        error = path + ": unknown mode";
+        return false;
+    }
+    auto positive = [](float value) { return value > 0 && std::isfinite(value); };
+    if (!positive(settings.equipotential_spacing) || !positive(settings.grid_spacing))
+    {
+        error = path + ": bad spacing";
+        return false;
+    }
+    if (!positive(settings.trace.step) || !positive(settings.trace.min_step) || !positive(settings.trace.max_step) ||
+        settings.trace.max_step < settings.trace.min_step || !positive(settings.trace.tolerance))
+    {
+        error = path + ": bad step";
+        return false;
+    }
+    if (block > file->length() || count > (file->length() - block) / (3 * sizeof(float)))
+    {
+        error = path + " is shorter than its charge block";
+        return false;
+    }
+    float* values = reinterpret_cast<float*>(file->bytes() + block);
+    std::span<float> x(values, count), y(values + count, count), strength(values + 2 * count, count);
+    if constexpr (std::endian::native == std::endian::little)
+    {
+        scene.charges = charges_t::borrow(x, y, strength, std::move(file));
+    }
+    else
+    {
+        // The block cannot be used in place, swap into owned arrays instead
+        charges_t charges;
+        charges.reserve(count);
+        for (size_t i = 0; i < count; i++)
+        {
+            auto swap = [](float v) { return std::bit_cast<float>(std::byteswap(std::bit_cast<uint32_t>(v))); };
+            charges.add({{swap(x[i]), swap(y[i])}, swap(strength[i])});
+        }
+        scene.charges = std::move(charges);
+    }
+    scene.settings = settings;
+    return true;
+}
+
+bool saveScene(const std::string& path, const charges_t& charges, const render_settings_t& settings, std::string& error)
+{
+    // The charges may be borrowed from a mapping of `path` itself, so the file is written beside it and
+    // renamed over it once complete. Truncating it in place would pull the data out from under the mapping.
+    std::string temporary = path + ".tmp";
+    std::ofstream out(temporary, std::ios::binary);
+    if (!out)
+    {
+        error = "cannot write " + temporary;
+        return false;
+    }
+    std::ostringstream header;
+    header.precision(std::numeric_limits<float>::max_digits10);
+    header << magic << '\n';
+    visitSettings(settings,
+                  [&](const char* name, const auto& member)
+                  {
+                      header << name << ' ';
+                      writeValue(header, member);
+                      header << '\n';
+                  });
+    header << "charges " << charges.size() << '\n';
+    std::string text = header.str();
+    text.resize((text.size() + block_alignment - 1) / block_alignment * block_alignment, '\0');
+    out.write(text.data(), static_cast<std::streamsize>(text.size()));
+
+    for (std::span<const float> values : {std::span<const float>(charges.x), std::span<const float>(charges.y), std::span<const float>(charges.strength)})
+    {
+        if constexpr (std::endian::native == std::endian::little)
+        {
+            out.write(reinterpret_cast<const char*>(values.data()), static_cast<std::streamsize>(values.size_bytes()));
+        }
+        else
+        {
+            for (float v : values)
+            {
+                uint32_t bits = std::byteswap(std::bit_cast<uint32_t>(v));
+                out.write(reinterpret_cast<const char*>(&bits), sizeof(bits));
+            }
+        }
+    }
+    out.close();
+    if (!out)
+    {
+        error = "failed writing " + temporary;
+        std::remove(temporary.c_str());
+        return false;
+    }
+    std::error_code code;
+    std::filesystem::rename(temporary, path, code);
+    if (code)
+    {
+        error = "cannot replace " + path + ": " + code.message();
+        std::remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,24 @@
+#pragma once
+#include "render.h"
+#include <string>
+
+// Scene files start with a text header of `key value` lines holding the render settings:
+//
+//     gauss-scene 1
+//     num_lines 16
+//     ...
+//     charges <count>
+//
+// After the charges line the file is padded with zeros to a multiple of 64 bytes, then holds <count> x,
+// <count> y and <count> strength values as little-endian 32-bit floats. That block is mapped copy-on-write
+// and used as the charge arrays directly, so loading costs page faults instead of parsing.
+struct scene_t
+{
+    charges_t charges;
+    render_settings_t settings;
+};
+
+// Unknown header keys are skipped and missing ones keep their defaults.
+// Both return false with a message in `error` when the file cannot be used.
+bool loadScene(const std::string& path, scene_t& scene, std::string& error);
+bool saveScene(const std::string& path, const charges_t& charges, const render_settings_t& settings, std::string& error);
@@ -0,0 +1,108 @@
+#include "solver.h"
+#include <bit>
+
+void solver_t::prepare(const charges_t& charges)
+{
+    this->charges = &charges;
+    if (method == method_t::barnes_hut)
+    {
+        tree.sync(charges);
+    }
+    if (method == method_t::fmm)
+    {
+        fmm.sync(charges, view_lo, view_hi);
+    }
+    if (use_grid && grid.stale(charges.version, settingsKey(), grid_spacing, view_lo, view_hi))
+    {
+        grid.build(charges.version, settingsKey(), grid_spacing, view_lo, view_hi,
+                   [this](std::span<const vec2_t> points, std::span<vec2_t> forces) { forceAt(points, forces); });
+    }
+}
+
+float solver_t::potentialAt(vec2_t p) const
+{
+    evaluations.add(1);
+    switch (method)
+    {
+    case method_t::barnes_hut:
+        return tree.potentialAt(p, theta);
+    case method_t::fmm:
+        return fmm.potentialAt(p);
+    default:
+        return ::potentialAt(*charges, p);
+    }
+}
+
+void solver_t::potentialAt(std::span<const vec2_t> points, std::span<float> potentials) const
+{
+    evaluations.add(points.size());
+    switch (method)
+    {
+    case method_t::barnes_hut:
+        for (size_t i = 0; i < points.size(); i++)
+        {
+            potentials[i] = tree.potentialAt(points[i], theta);
+        }
+        break;
+    case method_t::fmm:
+        for (size_t i = 0; i < points.size(); i++)
+        {
+            potentials[i] = fmm.potentialAt(points[i]);
+        }
+        break;
+    default:
+        ::potentialAt(*charges, points, potentials);
+        break;
+    }
+}
+
+uint64_t solver_t::settingsKey() const
+{
+    return static_cast<uint64_t>(method) | uint64_t(std::bit_cast<uint32_t>(theta)) << 8 | uint64_t(fmm.order) << 40;
+}
+
+vec2_t solver_t::sample(vec2_t p) const
+{
+    if (use_grid && grid.contains(p))
+    {
+        return grid.sample(p, interpolation);
+    }
+    return forceAt(p);
+}
+
+vec2_t solver_t::forceAt(vec2_t p) const
+{
+    evaluations.add(1);
+    switch (method)
+    {
+    case method_t::barnes_hut:
+        return tree.forceAt(p, theta);
+    case method_t::fmm:
+        return fmm.forceAt(p);
+    default:
+        return ::forceAt(*charges, p);
+    }
+}
+
+void solver_t::forceAt(std::span<const vec2_t> points, std::span<vec2_t> forces) const
+{
+    evaluations.add(points.size());
+    switch (method)
+    {
+    case method_t::barnes_hut:
+        for (size_t i = 0; i < points.size(); i++)
+        {
+            forces[i] = tree.forceAt(points[i], theta);
+        }
+        break;
+    case method_t::fmm:
+        for (size_t i = 0; i < points.size(); i++)
+        {
+            forces[i] = fmm.forceAt(points[i]);
+        }
+        break;
+    default:
+        ::forceAt(*charges, points, forces);
+        break;
+    }
+}
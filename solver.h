@@ -0,0 +1,51 @@
+#pragma once
+#include "field.h"
+#include "field_grid.h"
+#include "fmm.h"
+#include "parallel.h"
+#include "quadtree.h"
+#include <span>
+
+enum class method_t
+{
+    direct,
+    barnes_hut,
+    fmm,
+};
+
+inline const char* method_names[] = {"Direct", "Barnes-Hut", "FMM"};
+
+// Picks the field evaluator and owns whatever acceleration structure it needs
+struct solver_t
+{
+    method_t method = method_t::direct;
+    float theta = 0.5f;
+    quadtree_t tree;
+    fmm_t fmm;
+    // Region the queries will mostly fall in, the fmm tree is built to cover it
+    vec2_t view_lo = vec2_t(0.0f), view_hi = vec2_t(0.0f);
+    // Cache over the view region that sample() interpolates from instead of evaluating the charges
+    bool use_grid = false;
+    float grid_spacing = 1.0f;
+    interpolation_t interpolation = interpolation_t::bilinear;
+    field_grid_t grid;
+
+    // Must be called after the charges change and before any forceAt, the charges have to outlive the calls
+    void prepare(const charges_t& charges);
+
+    vec2_t forceAt(vec2_t p) const;
+    void forceAt(std::span<const vec2_t> points, std::span<vec2_t> forces) const;
+    float potentialAt(vec2_t p) const;
+    void potentialAt(std::span<const vec2_t> points, std::span<float> potentials) const;
+    // Field for the tracers, interpolated from the grid where it is enabled and covers p
+    vec2_t sample(vec2_t p) const;
+    // Identifies the method and its settings, for caches of values computed through the solver
+    uint64_t settingsKey() const;
+
+    // Field and potential evaluations made so far from any thread, interpolated grid samples not included
+    uint64_t evaluationCount() const { return evaluations.total(); }
+
+private:
+    const charges_t* charges = nullptr;
+    mutable sharded_counter_t evaluations;
+};
@@ -0,0 +1,116 @@
+#include "tracer.h"
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+    struct direction_field_t
+    {
+        const solver_t& solver;
+        float sign;
+        size_t& evaluations;
+
+        // Unit direction at p, false where the field vanishes
+        bool operator()(vec2_t p, vec2_t& out) const
+        {
+            evaluations++;
+            vec2_t force = solver.sample(p);
+            float length = glm::length(force);
+            if (!(length > 0.0f) || !std::isfinite(length))
+            {
+                return false;
+            }
+            out = (sign / length) * force;
+            return true;
+        }
+    };
+
+    // Dormand-Prince 5(4) tableau
+    constexpr float a21 = 1.0f / 5;
+    constexpr float a31 = 3.0f / 40, a32 = 9.0f / 40;
+    constexpr float a41 = 44.0f / 45, a42 = -56.0f / 15, a43 = 32.0f / 9;
+    constexpr float a51 = 19372.0f / 6561, a52 = -25360.0f / 2187, a53 = 64448.0f / 6561, a54 = -212.0f / 729;
+    constexpr float a61 = 9017.0f / 3168, a62 = -355.0f / 33, a63 = 46732.0f / 5247, a64 = 49.0f / 176, a65 = -5103.0f / 18656;
+    constexpr float b1 = 35.0f / 384, b3 = 500.0f / 1113, b4 = 125.0f / 192, b5 = -2187.0f / 6784, b6 = 11.0f / 84;
+    // Fifth minus fourth order weights
+    constexpr float e1 = 71.0f / 57600, e3 = -71.0f / 16695, e4 = 71.0f / 1920, e5 = -17253.0f / 339200, e6 = 22.0f / 525, e7 = -1.0f / 40;
+} // namespace
+
+polyline_t traceFieldLine(const solver_t& solver, vec2_t p, float sign, const trace_settings_t& settings, size_t& evaluations)
+{
+    direction_field_t f{solver, sign, evaluations};
+    polyline_t line{p};
+    vec2_t k1;
+    if (!f(p, k1))
+    {
+        return line;
+    }
+    auto inside = [&](vec2_t q) { return q.x >= settings.lo.x && q.x <= settings.hi.x && q.y >= settings.lo.y && q.y <= settings.hi.y; };
+    float h = std::clamp(settings.step, settings.min_step, settings.max_step);
+    float length = 0;
+    while (length < settings.max_length && inside(p))
+    {
+        vec2_t next, k_next;
+        bool valid = true;
+        switch (settings.integrator)
+        {
+        case integrator_t::euler:
+            next = p + h * k1;
+            valid = f(next, k_next);
+            break;
+        case integrator_t::rk4:
+        {
+            vec2_t k2, k3, k4;
+            valid = f(p + 0.5f * h * k1, k2) && f(p + 0.5f * h * k2, k3) && f(p + h * k3, k4);
+            next = p + (h / 6) * (k1 + 2.0f * k2 + 2.0f * k3 + k4);
+            valid = valid && f(next, k_next);
+            break;
+        }
+        case integrator_t::rk45:
+            // Retry with smaller steps until the embedded error estimate is within tolerance
+            while (true)
+            {
+                vec2_t k2, k3, k4, k5, k6;
+                valid = f(p + h * (a21 * k1), k2) && f(p + h * (a31 * k1 + a32 * k2), k3) && f(p + h * (a41 * k1 + a42 * k2 + a43 * k3), k4) &&
+                        f(p + h * (a51 * k1 + a52 * k2 + a53 * k3 + a54 * k4), k5) &&
+                        f(p + h * (a61 * k1 + a62 * k2 + a63 * k3 + a64 * k4 + a65 * k5), k6);
+                next = p + h * (b1 * k1 + b3 * k3 + b4 * k4 + b5 * k5 + b6 * k6);
+                valid = valid && f(next, k_next);
+                if (!valid)
+                {
+                    break;
+                }
+                float error = h * glm::length(e1 * k1 + e3 * k3 + e4 * k4 + e5 * k5 + e6 * k6 + e7 * k_next);
+                float scale = error > 0 ? std::clamp(0.9f * std::pow(settings.tolerance / error, 0.2f), 0.2f, 5.0f) : 5.0f;
+                if (error <= settings.tolerance || h <= settings.min_step)
+                {
+                    length += h;
+                    h = std::clamp(h * scale, settings.min_step, settings.max_step);
+                    break;
+                }
+                h = std::clamp(h * scale, settings.min_step, settings.max_step);
+            }
+            break;
+        default:
+            valid = false;
+            break;
+        }
+        if (!valid)
+        {
+            break;
+        }
+        if (settings.integrator != integrator_t::rk45)
+        {
+            length += h;
+        }
+        line.push_back(next);
+        // A direction that turns around within one step means the line ran into a charge
+        if (glm::dot(k1, k_next) < 0.0f)
+        {
+            break;
+        }
+        p = next;
+        k1 = k_next;
+    }
+    return line;
+}
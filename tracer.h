@@ -0,0 +1,33 @@
+#pragma once
+#include "contour.h"
+#include "solver.h"
+#include <cstddef>
+
+enum class integrator_t
+{
+    euler,
+    rk4,
+    rk45,
+};
+
+inline const char* integrator_names[] = {"Euler", "RK4", "RK45 (adaptive)"};
+
+struct trace_settings_t
+{
+    integrator_t integrator = integrator_t::euler;
+    // Fixed step for Euler and RK4, first step for RK45
+    float step = 1.0f;
+    // Allowed position error per RK45 step, in pixels
+    float tolerance = 0.01f;
+    float min_step = 0.05f, max_step = 16.0f;
+    // Longest arc length traced
+    float max_length = 200.0f;
+    vec2_t lo = vec2_t(0.0f), hi = vec2_t(0.0f);
+
+    bool operator==(const trace_settings_t&) const = default;
+};
+
+// Follows the unit field direction (reversed for sign < 0) from p until the field vanishes, the line
+// leaves [lo, hi], it crosses a charge or max_length of arc is covered. The first point is p.
+// Every field evaluation is added to `evaluations`.
+polyline_t traceFieldLine(const solver_t& solver, vec2_t p, float sign, const trace_settings_t& settings, size_t& evaluations);